@@ -13,15 +13,46 @@
 //	functions:
 //	hat_open:	open a new hat array returning a hat object.
 //	hat_close:	close an open hat array, freeing all memory.
+//	hat_save:	write the hat to an image file for hat_open_mapped.
+//	hat_open_mapped:	map a saved image read only, for hat_find and cursors.
 //	hat_data:	allocate data memory within hat array for external use.
 //	hat_cell:	insert a string into the HAT tree, return associated data addr.
-//	hat_cursor:	return a sort cursor for the HAT tree. Free with free().
+//	hat_find:	find a string in the HAT tree, return associated data addr.
+//	hat_find_batch:	find an array of strings, interleaving their cache misses.
+//	hat_delete:	remove a string from the HAT tree, return TRUE/FALSE.
+//	hat_thread:	open a handle with its own allocator for another writer thread.
+//	hat_cell_mt:	hat_cell from any thread's handle, copying in the data under a root latch.
+//	hat_find_mt:	hat_find while other threads write, copying out the data, latch free under HAT_EBR.
+//	hat_delete_mt:	hat_delete from any thread's handle.
+//	hat_bulk_load:	insert a buffer of newline terminated strings with several threads.
+//	hat_log_open:	replay a write-ahead log into the hat, then log to it, with group commit if durable.
+//	hat_log_cell:	hat_cell_mt, logging the key and its data.
+//	hat_log_delete:	hat_delete_mt, logging the delete.
+//	hat_log_sync:	make every logged change durable now.
+//	hat_snapshot_async:	save an image from a forked child while inserts go on.
+//	hat_snapshot_status:	report a snapshot's progress and copy-on-write bytes.
+//	hat_snapshot_wait:	wait for a snapshot to finish, return TRUE/FALSE.
+//	hat_count:	return the number of nodes of an allocation class in use.
+//	hat_cursor:	return a sort cursor for the HAT tree. Free with hat_cursor_close().
+//	hat_cursor_reset:	return a cursor to its opened state for reuse.
+//	hat_cursor_limit:	sort buckets only a given number of keys at a time, for short scans.
+//	hat_cursor_close:	free a cursor and its key array.
 //	hat_key:	return the key from the HAT trie at the current cursor location.
+//	hat_key_parts:	return pointers to the prefix and rest of the key at the cursor, without copying.
 //	hat_nxt:	move the cursor to the next key in the HAT trie, return TRUE/FALSE.
 //	hat_prv:	move the cursor to the prev key in the HAT trie, return TRUE/FALSE.
 //	hat_start:	move the cursor to the first key >= given key, return TRUE/FALSE.
 //	hat_last:	move the cursor to the last key in the HAT trie, return TRUE/FALSE
+//	hat_first:	move the cursor to the first key in the HAT trie, return TRUE/FALSE
 //	hat_slot:	return the pointer to the associated data area for cursor.
+//	hat_range:	fill a buffer with records of the next keys in a range, in order.
+//	hat_range_rev:	fill a buffer with records of the next keys in a range, in reverse.
+//	hat_prefix_scan:	call back for every key with a given prefix, in key order.
+//	hat_prefix_walk:	call back for every key with a given prefix, in no order.
+//	hat_reader:	-D HAT_EBR: claim a reader slot for a thread, return its id or -1.
+//	hat_enter:	-D HAT_EBR: begin a read section for the reader id.
+//	hat_exit:	-D HAT_EBR: end the read section for the reader id.
+//	hat_reader_close:	-D HAT_EBR: release the reader slot.
 
 #ifdef linux
 	#define _GNU_SOURCE
@@ -50,6 +81,18 @@
 #include <memory.h>
 #include <string.h>
 
+//	vectorized key comparison in array nodes,
+//	scalar fallback when neither is available
+
+#if defined(__AVX2__)
+	#include <immintrin.h>
+	#define HAT_avx2
+	#define HAT_sse2
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+	#include <emmintrin.h>
+	#define HAT_sse2
+#endif
+
 #if defined(_WIN32)
 typedef unsigned short ushort;
 #endif
@@ -88,12 +131,163 @@ typedef unsigned int uint;
 
 #define HAT_node_size	16
 
+//	compiling with -D HAT_TAGS stores a one byte hash tag
+//	in front of each key's length prefix in array nodes,
+//	letting scans skip keycmp on most mismatches
+
+#ifdef HAT_TAGS
+	#define HAT_tag 1
+#else
+	#define HAT_tag 0
+#endif
+
+//	compiling with -D HAT_EBR lets any number of reader
+//	threads call hat_find and hat_find_batch while one
+//	writer thread inserts and deletes, or while writers
+//	holding root slot latches do through the _mt calls.
+//	Nodes are filled before their parent slot is published
+//	with a release store, and replaced nodes are retired to
+//	an epoch based reclamation list instead of being reused
+//	at once.
+
+#ifdef HAT_EBR
+	#define HAT_ebr 1
+	#define hat_publish(addr, val) __atomic_store_n (addr, val, __ATOMIC_RELEASE)
+	#define hat_load(addr) __atomic_load_n (addr, __ATOMIC_ACQUIRE)
+#else
+	#define HAT_ebr 0
+	#define hat_publish(addr, val) (*(addr) = (val))
+	#define hat_load(addr) (*(addr))
+#endif
+
+//	version latches for the multi-writer hat_cell_mt,
+//	hat_find_mt and hat_delete_mt entry points.  The
+//	version is odd while a writer holds the latch, and
+//	advances by two per write, so optimistic readers can
+//	tell whether a writer came and went.
+
+#if defined(_WIN32)
+	#include <windows.h>
+	#include <intrin.h>
+	#include <io.h>
+	#define hat_fsync(file) _commit (_fileno (file))
+	#define hat_truncate(file, len) _chsize_s (_fileno (file), len)
+	#define hat_yield() SwitchToThread ()
+	#define hat_cas(latch, old, val) (_InterlockedCompareExchange ((volatile long *)(latch), val, old) == (long)(old))
+	#define hat_casptr(addr, old, val) (InterlockedCompareExchangePointer ((void * volatile *)(addr), val, old) == (old))
+	#define hat_bump(latch) _InterlockedExchangeAdd ((volatile long *)(latch), 1)
+	#define hat_version(latch) (*(latch))
+	#define hat_fence() _ReadWriteBarrier ()
+	#define hat_add(addr, amt) _InterlockedExchangeAdd64 ((volatile __int64 *)(addr), amt)
+	#define hat_relax() _mm_pause ()
+	typedef HANDLE HatThread;
+	#define HAT_worker DWORD WINAPI
+	#define hat_spawn(thread, fn, arg) !(*(thread) = CreateThread (NULL, 0, fn, arg, 0, NULL))
+	#define hat_join(thread) (WaitForSingleObject (thread, INFINITE), CloseHandle (thread))
+#else
+	#include <pthread.h>
+	typedef pthread_t HatThread;
+	#define HAT_worker void *
+	#define hat_spawn(thread, fn, arg) pthread_create (thread, NULL, fn, arg)
+	#define hat_join(thread) pthread_join (thread, NULL)
+	#define hat_cas(latch, old, val) __sync_bool_compare_and_swap (latch, old, val)
+	#define hat_casptr(addr, old, val) __sync_bool_compare_and_swap (addr, old, val)
+	#define hat_bump(latch) __atomic_fetch_add (latch, 1, __ATOMIC_RELEASE)
+	#define hat_version(latch) __atomic_load_n (latch, __ATOMIC_ACQUIRE)
+	#define hat_fence() __atomic_thread_fence (__ATOMIC_ACQUIRE)
+	#define hat_add(addr, amt) __atomic_fetch_add (addr, amt, __ATOMIC_RELAXED)
+	#include <sched.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <sys/wait.h>
+	#include <errno.h>
+	#define hat_fsync(file) fsync (fileno (file))
+	#define hat_truncate(file, len) ftruncate (fileno (file), len)
+	#define hat_yield() sched_yield ()
+	#if defined(HAT_sse2)
+		#define hat_relax() _mm_pause ()
+	#else
+		#define hat_relax()
+	#endif
+#endif
+
+//	compiling with -D HAT_BINARY makes the trie binary safe:
+//	radix nodes and root levels fan out 257 ways, with
+//	index zero reserved for end-of-key and byte values
+//	stored as index 1 thru 256.  Otherwise they fan out
+//	128 ways over 7 bit keys, with byte zero doubling as
+//	end-of-key.
+
+#ifdef HAT_BINARY
+	#define HAT_binary 1
+	#define HAT_fanout 257
+	typedef unsigned short HatRadixKey;
+#else
+	#define HAT_binary 0
+	#define HAT_fanout 128
+	typedef unsigned char HatRadixKey;
+#endif
+
+//	64 bit key hash codes: the bucket slot, pail slot
+//	and key tag are taken from separate bit ranges
+//	so one hash serves every level of a descent
+
+typedef unsigned long long HatCode;
+
+//	slots are chosen from the 32 bit ranges by Lemire's
+//	multiply-shift fastrange, avoiding an integer division
+//	per level.  Compile with -D HAT_MODULO for the older
+//	remainder selection to compare against.
+
+#define hat_tag(code) ((uchar)((code) >> 8))
+
+#ifdef HAT_MODULO
+	#define hat_reduce(hash, slots) ((uint)(hash) % (slots))
+	#define HAT_slot_mode "modulo"
+#else
+	#define hat_reduce(hash, slots) ((uint)(((HatCode)(uint)(hash) * (slots)) >> 32))
+	#define HAT_slot_mode "fastrange"
+#endif
+
+#define hat_bucket_slot(code) hat_reduce ((code) >> 32, HatBucketSlots)
+#define hat_pail_slot(code) hat_reduce (code, HatPailMax)
+
+//	prefetch the cache line holding the given address
+
+#if defined(__GNUC__) || defined(__clang__)
+	#define hat_prefetch(addr) __builtin_prefetch (addr)
+#elif defined(HAT_sse2)
+	#define hat_prefetch(addr) _mm_prefetch ((char *)(addr), _MM_HINT_T0)
+#else
+	#define hat_prefetch(addr)
+#endif
+
+//	compiling with -D HAT_ORDER keeps the sorted order
+//	cursors find for a bucket or pail on the node, as
+//	the position of each key in the order they are
+//	stripped out, until an insert or delete changes it
+
+#ifdef HAT_ORDER
+typedef struct {
+	uint cnt;			// number of keys ordered
+	ushort pos[0];		// sorted position by strip index
+} HatOrder;
+#endif
+
 typedef struct {
+#ifdef HAT_ORDER
+	HatOrder *order;	// cached sorted order
+#endif
 	HatSlot array[0];	// hash array of pail arrays
 } HatPail;
 
 typedef struct {
 	uint count;
+#ifdef HAT_ORDER
+	HatOrder *order;	// cached sorted order
+#endif
 	HatSlot slots[0];
 } HatBucket;
 
@@ -138,10 +332,56 @@ enum HAT_types {
 	HAT_16			= 13,
 	HAT_24			= 14,
 	HAT_32			= 15,
+	HAT_node4		= 32,	// adaptive radix node classes
+	HAT_node16		= 33,
+	HAT_node48		= 34,
+};
+
+//	slot types 4 thru 6 hold the smaller adaptive
+//	radix nodes, which grow into the full HAT_fanout
+//	slot HAT_radix node as children are added
+
+enum HAT_radix_types {
+	HAT_radix4		= 4,	// 4 sorted keys
+	HAT_radix16		= 5,	// 16 sorted keys
+	HAT_radix48		= 6,	// 48 slots indexed by key
 };
 
-uint HatSize[32] = {
-	(HAT_slot_size * 128),	// HAT_radix node size
+#define HAT_isradix(node) (((node) & HAT_type) == HAT_radix || ((node) & HAT_type) >= HAT_radix4)
+
+//	every radix node counts the keys in its subtree,
+//	the full HAT_radix node in the slot after its table
+
+typedef struct {
+	uint count;			// keys in subtree
+	uchar cnt;			// number of children
+	HatRadixKey keys[4];	// sorted child key indexes
+	HatSlot slots[4];	// child nodes
+} HatRadix4;
+
+typedef struct {
+	uint count;			// keys in subtree
+	uchar cnt;			// number of children
+	HatRadixKey keys[16];	// sorted child key indexes
+	HatSlot slots[16];	// child nodes
+} HatRadix16;
+
+typedef struct {
+	uint count;			// keys in subtree
+	uchar cnt;			// number of children
+	uchar index[HAT_fanout];	// child slot + 1 by key index
+	HatSlot slots[48];	// child nodes
+} HatRadix48;
+
+//	radix nodes collapse back into an array or bucket
+//	when a delete leaves this many keys below them
+
+#define HAT_collapse (HatBucketMax / 4)
+
+#define HAT_classes 35
+
+uint HatSize[HAT_classes] = {
+	(HAT_slot_size * (HAT_fanout + 1)),	// HAT_radix node size
 	(sizeof(HatBucket)),	// HAT_bucket node size
 	(0),					// HAT_array node size below
 	(sizeof(HatPail)),		// HAT_pail node size
@@ -157,6 +397,9 @@ uint HatSize[32] = {
 	(16 * HAT_node_size),	// HAT_16 array size
 	(24 * HAT_node_size),	// HAT_24 array size
 	(32 * HAT_node_size),	// HAT_32 array size
+	[HAT_node4] = sizeof(HatRadix4),
+	[HAT_node16] = sizeof(HatRadix16),
+	[HAT_node48] = sizeof(HatRadix48),
 };
 
 uint HatBucketSlots = 2047;
@@ -170,13 +413,62 @@ typedef struct {
 	uint next;			// next available offset
 } HatSeg;
 
+//	root slots are guarded for hat_cell_mt by a
+//	stripe of latches, one per cache line
+
+#define HAT_stripes 1024
+
+typedef struct {
+	volatile uint latch;	// version, odd while held
+	uchar filler[60];	// keep latches on separate cache lines
+} HatLock;
+
+#ifdef HAT_EBR
+#define HAT_readers 64		// reader thread slots
+#define HAT_reclaim 256		// retired blocks between reclaims
+
+//	each reader slot holds the epoch the reader entered
+//	in, or zero while it is outside the trie
+
+typedef struct {
+	unsigned long long epoch;	// entered epoch or zero
+	uint used;			// slot assigned to a thread
+	uchar filler[52];	// keep readers on separate cache lines
+} HatReader;
+
 typedef struct {
-	void **reuse[32];	// reuse hat blocks
-	int counts[32];		// hat block counters
+	void *block;		// retired node
+	uint type;			// its allocation class
+	unsigned long long epoch;	// epoch it was retired in
+} HatRetire;
+#endif
+
+//	each hat_thread handle shares the root array and
+//	latches of the hat it was opened on, but allocates
+//	from its own segments and reuse lists
+
+typedef struct Hat {
+	void **reuse[HAT_classes];	// reuse hat blocks
+	int counts[HAT_classes];	// hat block counters
 	HatSeg *seg;		// current hat allocator
 	uint bootlvl;		// cascaded radix nodes in root
 	uint aux;			// auxilliary bytes per key
-	HatSlot root[0];	// base root of hat array
+	HatSlot *root;		// base root of hat array
+	HatLock *locks;		// root slot latch stripes
+	struct Hat *main;	// hat the handle was opened on, or itself
+	struct Hat *threads;	// next thread handle on main hat
+	volatile uint latch;	// guards the thread handle chain
+	void *image;		// read only image from hat_open_mapped
+	unsigned long long imagesize;	// bytes mapped
+	void *log;			// write-ahead log from hat_log_open
+#ifdef HAT_EBR
+	HatReader readers[HAT_readers];	// reader epochs
+	unsigned long long epoch;	// global epoch
+	HatRetire *retire;	// retired blocks, oldest first
+	uint retired;		// count of retired blocks
+	uint retiremax;		// allocated retire entries
+	int reader;			// reader slot for hat_find_mt
+#endif
 } Hat;
 
 typedef struct {
@@ -187,10 +479,30 @@ typedef struct {
 } HatBase;
 
 typedef struct {
-	uchar *key;			// pointer to key string
+	HatCode word;		// 8 key bytes at sort depth
+	uint len;			// key length
+#ifdef HAT_ORDER
+	uint idx;			// strip index, then sorted position
+#endif
+	uchar *key;			// key bytes
 	void *slot;			// user data area
 } HatSort;
 
+#ifdef HAT_MERGE
+//	compiling with -D HAT_MERGE keeps the keys of every
+//	array node in sorted order, and cursors merge the
+//	arrays of a bucket or pail through a loser tree of
+//	runs instead of stripping and sorting all its keys
+
+typedef struct {
+	HatBase *base;		// sorted array node
+	uchar *key;			// current key bytes, NULL when run out
+	uint len;			// current key length
+	ushort off;			// offset of the key after it
+	ushort idx;			// index of current key
+} HatRun;
+#endif
+
 typedef struct {
 	int cnt;			// number of bucket keys
 	int idx;			// current bucket index
@@ -199,13 +511,177 @@ typedef struct {
 	int rootlvl;		// number of root levels
 	uint maxroot;		// count of root array slots
 	uint rootscan;		// triple root scan index
+	uint rootmin;		// first root slot to visit
+	uint rootmax;		// root slot to stop before
 	HatSlot next[256];	// radix node stack
-	uchar scan[256];	// radix node scan index stack
-	HatSort keys[0];	// sorted array for bucket
+	ushort scan[256];	// radix node scan index stack
+	ushort depth[257];	// key bytes above each stack level
+	uchar path[512];	// key bytes from root and radix levels
+	HatSort *keys;		// sorted array for bucket
+	uint max;			// entries allocated in keys
+	uint limit;			// keys to sort per step, zero for whole nodes
+	uint low;			// first key of the sorted run
+	uint sorted;		// key after the sorted run
+	uint range;			// hat_range: 0 to seek, 1 under way, 2 done
+#ifdef HAT_ORDER
+	uint mapped;		// read only image, orders are not cached
+#endif
+#ifdef HAT_MERGE
+	HatRun *runs;		// array runs of the merged node
+	uint *tree;			// loser tree, winning run in slot zero
+	uint nrun;			// number of runs
+	uint maxrun;		// runs allocated
+	int dir;			// merge direction
+#endif
 } HatCursor;
 
 int hat_nxt (HatCursor *cursor);
 
+#if defined(__GNUC__) || defined(__clang__)
+	#define hat_ctz(bits) __builtin_ctz (bits)
+#else
+int hat_ctz (uint bits)
+{
+int idx = 0;
+
+	while( !(bits & 1) )
+		bits >>= 1, idx++;
+
+	return idx;
+}
+#endif
+
+//	find the child slot for key index ch
+//	in a radix node, or NULL if it has none
+
+HatSlot *hat_radix_find (HatSlot node, uint ch)
+{
+HatRadix4 *radix4;
+HatRadix16 *radix16;
+HatRadix48 *radix48;
+uint idx;
+
+	switch( node & HAT_type ) {
+	case HAT_radix4:
+	  radix4 = (HatRadix4 *)(node & HAT_mask);
+
+	  for( idx = 0; idx < radix4->cnt; idx++ )
+		if( radix4->keys[idx] == ch )
+		  return radix4->slots + idx;
+
+	  return NULL;
+
+	case HAT_radix16:
+	  radix16 = (HatRadix16 *)(node & HAT_mask);
+#if defined(HAT_sse2) && defined(HAT_BINARY)
+	  idx = _mm_movemask_epi8 (_mm_packs_epi16 (
+		_mm_cmpeq_epi16 (_mm_set1_epi16 ((short)ch), _mm_loadu_si128 ((__m128i *)radix16->keys)),
+		_mm_cmpeq_epi16 (_mm_set1_epi16 ((short)ch), _mm_loadu_si128 ((__m128i *)(radix16->keys + 8)))));
+
+	  if( idx &= (1 << radix16->cnt) - 1 )
+		return radix16->slots + hat_ctz (idx);
+#elif defined(HAT_sse2)
+	  idx = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_set1_epi8 ((char)ch), _mm_loadu_si128 ((__m128i *)radix16->keys)));
+
+	  if( idx &= (1 << radix16->cnt) - 1 )
+		return radix16->slots + hat_ctz (idx);
+#else
+	  for( idx = 0; idx < radix16->cnt; idx++ )
+		if( radix16->keys[idx] == ch )
+		  return radix16->slots + idx;
+#endif
+	  return NULL;
+
+	case HAT_radix48:
+	  radix48 = (HatRadix48 *)(node & HAT_mask);
+
+	  if( idx = hat_load (&radix48->index[ch]) )
+		return radix48->slots + idx - 1;
+
+	  return NULL;
+	}
+
+	return (HatSlot *)(node & HAT_mask) + ch;
+}
+
+//	return the subtree key count of a radix node
+
+uint *hat_radix_count (HatSlot node)
+{
+	switch( node & HAT_type ) {
+	case HAT_radix4:
+	  return &((HatRadix4 *)(node & HAT_mask))->count;
+	case HAT_radix16:
+	  return &((HatRadix16 *)(node & HAT_mask))->count;
+	case HAT_radix48:
+	  return &((HatRadix48 *)(node & HAT_mask))->count;
+	}
+
+	return (uint *)((HatSlot *)(node & HAT_mask) + HAT_fanout);
+}
+
+//	find the first occupied child key >= ch (dir > 0)
+//	or the last one <= ch (dir < 0) in a radix node,
+//	returning the key and child, or -1 if none
+
+int hat_radix_scan (HatSlot node, int ch, int dir, HatSlot *child)
+{
+HatRadix4 *radix4;
+HatRadix16 *radix16;
+HatRadix48 *radix48;
+HatRadixKey *keys;
+HatSlot *table;
+int idx, cnt;
+
+	switch( node & HAT_type ) {
+	case HAT_radix4:
+	  radix4 = (HatRadix4 *)(node & HAT_mask);
+	  table = radix4->slots;
+	  keys = radix4->keys;
+	  cnt = radix4->cnt;
+	  break;
+
+	case HAT_radix16:
+	  radix16 = (HatRadix16 *)(node & HAT_mask);
+	  table = radix16->slots;
+	  keys = radix16->keys;
+	  cnt = radix16->cnt;
+	  break;
+
+	case HAT_radix48:
+	  radix48 = (HatRadix48 *)(node & HAT_mask);
+
+	  for( ; ch >= 0 && ch < HAT_fanout; ch += dir )
+		if( idx = radix48->index[ch] )
+		  if( *child = radix48->slots[idx - 1] )
+			return ch;
+
+	  return -1;
+
+	default:
+	  table = (HatSlot *)(node & HAT_mask);
+
+	  for( ; ch >= 0 && ch < HAT_fanout; ch += dir )
+		if( *child = table[ch] )
+		  return ch;
+
+	  return -1;
+	}
+
+	//	sorted key nodes
+
+	if( dir > 0 ) {
+	  for( idx = 0; idx < cnt; idx++ )
+		if( keys[idx] >= ch && (*child = table[idx]) )
+		  return keys[idx];
+	} else
+	  for( idx = cnt; idx--; )
+		if( keys[idx] <= ch && (*child = table[idx]) )
+		  return keys[idx];
+
+	return -1;
+}
+
 //	ternery quick sort of cursor's keys
 //	modelled after R Sedgewick's
 //	"Quicksort with 3-way partitioning"
@@ -221,51 +697,82 @@ HatSort swap[1];
 	}	
 }
 
-void hat_qsort (HatSort *x, int n, uchar o)
+//	bucket keys are sorted by multikey quicksort on 8 byte
+//	words: each entry carries the big-endian word of its
+//	key at the current depth, zero padded, so partitions
+//	compare entries in the sort array alone.  Only the
+//	keys tied on a whole word are read again, 8 bytes on.
+
+HatCode hat_word (uchar *key, uint len, uint depth)
+{
+HatCode word = 0;
+uint idx;
+
+	if( depth + 8 <= len ) {
+		memcpy (&word, key + depth, 8);
+#if BYTE_ORDER == BIG_ENDIAN
+		return word;
+#elif defined(__GNUC__) || defined(__clang__)
+		return __builtin_bswap64 (word);
+#elif defined(_WIN32)
+		return _byteswap_uint64 (word);
+#endif
+	}
+
+	for( idx = depth; idx < depth + 8; idx++ )
+		word = word << 8 | (idx < len ? key[idx] : 0);
+
+	return word;
+}
+
+//	compare two keys that agree before depth
+
+int hat_sortcmp (HatSort *x, HatSort *y, uint depth)
+{
+uint len = x->len < y->len ? x->len : y->len;
+int diff;
+
+	if( x->word != y->word )
+		return x->word < y->word ? -1 : 1;
+
+	//	a key ending inside an equal word is a
+	//	prefix of the other, zeros padding it out
+
+	if( len > depth + 8 )
+	  if( diff = memcmp (x->key + depth + 8, y->key + depth + 8, len - depth - 8) )
+		return diff;
+
+	return (int)x->len - (int)y->len;
+}
+
+void hat_qsort (HatSort *x, int n, uint depth)
 {
-ushort skip, skipb, skipc, len;
-uchar pivot, chb, chc, *key;
 int a, b, c, d, r;
+HatCode pivot;
 HatSort swap[1];
 
-  while( n > 10 ) {
-	a = rand () % n;
+  while( n > 16 ) {
 
-	*swap = x[0];
-	x[0] = x[a];
-	x[a] = *swap;
+	//	pivot on the median of three words
 
-	len = x[0].key[0];
+	a = 0, b = n / 2, c = n - 1;
 
-	if( len & 0x80 )
-		len &= 0x7f, len += x[0].key[1] << 7, skip = 2;
-	else
-		skip = 1;
+	if( x[a].word > x[b].word )
+		r = a, a = b, b = r;
+	if( x[b].word > x[c].word )
+		b = x[a].word > x[c].word ? a : c;
 
-	if( len > o )
-		pivot = x[0].key[o+skip];
-	else
-		pivot = 0;
+	*swap = x[0];
+	x[0] = x[b];
+	x[b] = *swap;
 
+	pivot = x[0].word;
 	a = b = 1;
 	c = d = n - 1;
 
 	while( 1 ) {
-		while( b <= c ) {
-		  len = x[b].key[0];
-
-		  if( len & 0x80 )
-			len &= 0x7f, len += x[b].key[1] << 7, skip = 2;
-		  else
-			skip = 1;
-
-		  if( len > o )
-			chb = x[b].key[o+skip];
-		  else
-			chb = 0;
-		  if( chb > pivot )
-			break;
-		  if( chb == pivot ) {
+		while( b <= c && x[b].word <= pivot ) {
+		  if( x[b].word == pivot ) {
 			*swap = x[a];
 			x[a++] = x[b];
 			x[b] = *swap;
@@ -273,21 +780,8 @@ HatSort swap[1];
 		  b += 1;
 		}
 
-		while( b <= c ) {
-		  len = x[c].key[0];
-
-		  if( len & 0x80 )
-			len &= 0x7f, len += x[c].key[1] << 7, skip = 2;
-		  else
-			skip = 1;
-
-		  if( len > o )
-			chc = x[c].key[o+skip];
-		  else
-			chc = 0;
-		  if( chc < pivot )
-			break;
-		  if( chc == pivot ) {
+		while( b <= c && x[c].word >= pivot ) {
+		  if( x[c].word == pivot ) {
 			*swap = x[c];
 			x[c] = x[d];
 			x[d--] = *swap;
@@ -310,195 +804,609 @@ HatSort swap[1];
 	vecswap (b, n-r, r, x);
 
 	if( r = d - c )
-		hat_qsort (x + n - r, r, o);
+		hat_qsort (x + n - r, r, depth);
 
 	if( r = b - a )
-		hat_qsort (x, r, o);
+		hat_qsort (x, r, depth);
 
-	len = x[r].key[0];
+	//	keys tied on the pivot word: those ending
+	//	inside it come first, shortest first, and
+	//	the rest are sorted on their next word
 
-	if( len & 0x80 )
-		len &= 0x7f, len += x[r].key[1] << 7;
-
-	if( len == o )
-		return;
-
-	n += a - d - 1;
 	x += r;
-	o += 1;
-  }
+	n += a - d - 1;
+	r = 0;
 
-  if( n > 1 ) {
-	a = 0;
+	for( a = 0; a < n; a++ )
+	  if( x[a].len <= depth + 8 ) {
+		*swap = x[r];
+		x[r++] = x[a];
+		x[a] = *swap;
+	  }
 
-	while( ++a < n )
-	  for( b = a; b > 0; b-- ) {
-		chb = x[b-1].key[0];
-		if( chb & 0x80 )
-			chb &= 0x7f, chb += x[b-1].key[1] << 7, skipb = 2;
-		else
-			skipb = 1;
-		chc = x[b].key[0];
-		if( chc & 0x80 )
-			chc &= 0x7f, chc += x[b].key[1] << 7, skipc = 2;
-		else
-			skipc = 1;
-		r = o;
-		d = 0;
+	for( a = 1; a < r; a++ )
+	  for( b = a; b && x[b-1].len > x[b].len; b-- ) {
+		*swap = x[b];
+		x[b] = x[b-1];
+		x[b-1] = *swap;
+	  }
 
-		while( r < chb && r < chc )
-		  if( d = x[b-1].key[r+skipb] - x[b].key[r+skipc] )
-			break;
-		  else
-			r++;
+	x += r;
+	n -= r;
+	depth += 8;
 
-		if( d > 0 || d == 0 && chb > chc ) {
-		  *swap = x[b];
-		  x[b] = x[b-1];
-		  x[b-1] = *swap;
-		}
-	  }
+	for( a = 0; a < n; a++ )
+		x[a].word = hat_word (x[a].key, x[a].len, depth);
   }
+
+  for( a = 1; a < n; a++ )
+	for( b = a; b && hat_sortcmp (x + b - 1, x + b, depth) > 0; b-- ) {
+	  *swap = x[b];
+	  x[b] = x[b-1];
+	  x[b-1] = *swap;
+	}
 }
 
 //	strip out pointers from HAT_array node
-//	to elements of the sorted array
+//	onto the end of the cursor's sort array,
+//	growing it to fit the largest node sorted
 
-int hat_strip_array (HatCursor *cursor, HatSlot node, HatSort *list)
+void hat_strip_array (HatCursor *cursor, HatSlot node)
 {
 HatBase *base = (HatBase *)(node & HAT_mask);
 uint size = HatSize[base->type];
+HatSort *list;
 ushort tst = 0;
 ushort cnt = 0;
 ushort len;
 
+#ifdef HAT_MERGE
+  //	sorted arrays are merged in place
+
+  if( cursor->nrun == cursor->maxrun ) {
+	cursor->maxrun = cursor->maxrun ? 2 * cursor->maxrun : 64;
+
+	if( !(cursor->runs = realloc (cursor->runs, cursor->maxrun * sizeof(HatRun))) )
+		hat_abort ("Out of virtual memory");
+	if( !(cursor->tree = realloc (cursor->tree, cursor->maxrun * sizeof(uint))) )
+		hat_abort ("Out of virtual memory");
+  }
+
+  cursor->runs[cursor->nrun++].base = base;
+  cursor->cnt += base->cnt;
+  return;
+#endif
+
+  if( cursor->cnt + base->cnt > cursor->max ) {
+	cursor->max = cursor->max ? 2 * cursor->max : 256;
+
+	if( !(cursor->keys = realloc (cursor->keys, cursor->max * sizeof(HatSort))) )
+		hat_abort ("Out of virtual memory");
+  }
+
+  list = cursor->keys + cursor->cnt;
+
   while( tst < base->nxt ) {
+	tst += HAT_tag;
 	list[cnt].slot = (uchar *)base + size - (cnt+1) * cursor->aux;
-	list[cnt].key = base->keys + tst;
 	len = base->keys[tst++];
 	if( len & 0x80 )
 		len &= 0x7f, len += base->keys[tst++] << 7;
+	list[cnt].key = base->keys + tst;
+	list[cnt].len = len;
+	list[cnt].word = hat_word (base->keys + tst, len, 0);
 	tst += len;
 	cnt++;
   }
 
-  return cnt;
+  cursor->cnt += cnt;
 }
 
-int hat_strip_pail (HatCursor *cursor, HatSlot node, HatSort *list)
+void hat_strip_pail (HatCursor *cursor, HatSlot node)
 {
 HatPail *pail = (HatPail *)(node & HAT_mask);
-uint total = 0;
 int idx;
 
 	for( idx = 0; idx < HatPailMax; idx++ )
 	  if( pail->array[idx] )
-		total += hat_strip_array (cursor, pail->array[idx], list);
-
-	return total;
+		hat_strip_array (cursor, pail->array[idx]);
 }
 
-//	sort current bucket into cursor array
+#ifdef HAT_ORDER
+//	sort the keys just stripped from a bucket or pail
+//	by the node's cached order, swapping each into
+//	its sorted position, or sort them and cache the
+//	order found.  Cursors on other threads may race
+//	to cache it, the first one wins.
+
+void hat_ordered (HatCursor *cursor, HatOrder **cache)
+{
+HatOrder *order = hat_load (cache);
+HatSort *keys = cursor->keys;
+uint idx, pos;
+HatSort swap;
+
+  if( order && order->cnt == cursor->cnt ) {
+	for( idx = 0; idx < cursor->cnt; idx++ )
+	  keys[idx].idx = order->pos[idx];
+
+	for( idx = 0; idx < cursor->cnt; idx++ )
+	  while( (pos = keys[idx].idx) != idx )
+		swap = keys[pos], keys[pos] = keys[idx], keys[idx] = swap;
+
+	return;
+  }
+
+  for( idx = 0; idx < cursor->cnt; idx++ )
+	keys[idx].idx = idx;
+
+  hat_qsort (keys, cursor->cnt, 0);
+
+  if( order || cursor->cnt > 65536 )
+	return;
+
+  if( !(order = malloc (sizeof(HatOrder) + cursor->cnt * sizeof(ushort))) )
+	return;
+
+  order->cnt = cursor->cnt;
+
+  for( pos = 0; pos < cursor->cnt; pos++ )
+	order->pos[keys[pos].idx] = pos;
+
+  if( !hat_casptr (cache, NULL, order) )
+	free (order);
+}
+#endif
 
 //	find and sort current node entry
-//  either Bucket or Array
+//  either Bucket, Pail or Array.  With a cursor limit, a partial sort of a node
+//	bigger than the limit leaves its keys unsorted
+//	for hat_extend, unless an order is cached.
 
-void hat_sort (HatCursor *cursor)
+void hat_sort (HatCursor *cursor, int partial)
 {
+#ifdef HAT_ORDER
+HatOrder **order = NULL;
+HatPail *pail;
+#endif
 HatBucket *bucket;
-uint off, idx;
-uchar len, ch;
-uint cnt;
+uint idx;
+
+  cursor->low = cursor->sorted = 0;
+  cursor->cnt = 0;
+#ifdef HAT_MERGE
+  cursor->nrun = 0;
+#endif
 
   switch( cursor->next[cursor->top] & HAT_type ) {
   case HAT_array:
-	cursor->cnt = hat_strip_array (cursor, cursor->next[cursor->top], cursor->keys);
+	hat_strip_array (cursor, cursor->next[cursor->top]);
 	break;
 
   case HAT_pail:
-	cursor->cnt = hat_strip_pail (cursor, cursor->next[cursor->top], cursor->keys);
+	hat_strip_pail (cursor, cursor->next[cursor->top]);
+#ifdef HAT_ORDER
+	pail = (HatPail *)(cursor->next[cursor->top] & HAT_mask);
+	order = &pail->order;
+#endif
 	break;
 
   case HAT_bucket:
 	bucket = (HatBucket *)(cursor->next[cursor->top] & HAT_mask);
-	cursor->cnt = 0;
 
 	for( idx = 0; idx < HatBucketSlots; idx++ )
 	  switch( bucket->slots[idx] & HAT_type ) {
 	  case HAT_array:
-		cursor->cnt += hat_strip_array (cursor, bucket->slots[idx], cursor->keys + cursor->cnt);
+		hat_strip_array (cursor, bucket->slots[idx]);
 		continue;
 	  case HAT_pail:
-		cursor->cnt += hat_strip_pail (cursor, bucket->slots[idx], cursor->keys + cursor->cnt);
+		hat_strip_pail (cursor, bucket->slots[idx]);
 		continue;
 	  }
 
+#ifdef HAT_ORDER
+	order = &bucket->order;
+#endif
 	break;
-
   }
 
-  hat_qsort (cursor->keys, cursor->cnt, 0);
-}
+#ifdef HAT_MERGE
+  cursor->sorted = cursor->cnt;
+  return;
+#endif
 
-int hat_greater (HatCursor *cursor, uchar *buff, uint max)
-{
-ushort len;
-ushort tst;
+  if( !cursor->limit || cursor->cnt <= cursor->limit )
+	partial = 0;
 
-  //	find first key >= given key
+#ifdef HAT_ORDER
+  if( cursor->mapped )
+	order = NULL;
 
-  for( cursor->idx = 0; cursor->idx < cursor->cnt; cursor->idx++ ) {
-	tst = 1;
-    len = cursor->keys[cursor->idx].key[0];
-	if( len & 0x80 )
-		len &= 0x7f, len += cursor->keys[cursor->idx].key[1] << 7, tst = 2;
-    if( memcmp (cursor->keys[cursor->idx].key + tst, buff, len > max ? max : len) )
-  		continue;
-    if( len >= max )
-  		return 1;
+  if( order && (!partial || hat_load (order)) ) {
+	hat_ordered (cursor, order);
+	cursor->sorted = cursor->cnt;
+	return;
   }
+#endif
 
-  //	given key > every key in bucket
+  if( partial )
+	return;
 
-  return hat_nxt (cursor);
+  hat_qsort (cursor->keys, cursor->cnt, 0);
+  cursor->sorted = cursor->cnt;
 }
 
-//	open new sort cursor into collection
+//	move the smallest k of n unsorted keys to the
+//	front by quickselect on their depth zero words
 
-void *hat_cursor (Hat *hat)
+void hat_select (HatSort *x, int n, int k)
 {
-HatCursor *cursor;
-uint size;
+int low = 0, high = n - 1, a, b;
+HatSort pivot, swap;
+
+  while( low < high ) {
+	pivot = x[low + (high - low) / 2];
+	a = low, b = high;
+
+	while( a <= b ) {
+	  while( hat_sortcmp (x + a, &pivot, 0) < 0 )
+		a++;
+	  while( hat_sortcmp (x + b, &pivot, 0) > 0 )
+		b--;
+	  if( a <= b )
+		swap = x[a], x[a++] = x[b], x[b--] = swap;
+	}
+
+	if( k <= b )
+		high = b;
+	else if( k >= a )
+		low = a;
+	else
+		return;
+  }
+}
 
-	size = sizeof(HatCursor) + HatBucketMax * sizeof(HatSort);
-	cursor = malloc (size);
-	memset (cursor, 0, size);
+//	sort the next run of a partly sorted node:
+//	the cursor limit, or the run so far if longer,
+//	so a long scan sorts in doubling steps
 
-	cursor->next[0] = (HatSlot)hat->root;
-	cursor->aux = hat->aux;
-	cursor->maxroot = 1;
+void hat_extend (HatCursor *cursor)
+{
+uint step = cursor->sorted - cursor->low;
+uint left = cursor->cnt - cursor->sorted;
 
-	for( cursor->rootlvl = 0; cursor->rootlvl < hat->bootlvl; cursor->rootlvl++ )
-		cursor->maxroot *= 128;
+	if( step < cursor->limit )
+		step = cursor->limit;
 
-	return cursor;
+	if( step < left )
+		hat_select (cursor->keys + cursor->sorted, left, step);
+	else
+		step = left;
+
+	hat_qsort (cursor->keys + cursor->sorted, step, 0);
+	cursor->sorted += step;
 }
 
-void *hat_start (HatCursor *cursor, uchar *buff, uint max)
+//	compare a sort entry with the given key,
+//	which is NULL when a scan starts with no key
+
+int hat_seekcmp (HatSort *key, uchar *buff, uint max)
 {
-HatSlot *radix, *root;
-HatSlot next;
-uint off = 0;
-uint idx;
-uchar ch;
+uint len = key->len < max ? key->len : max;
+int diff;
+
+	if( len )
+	  if( diff = memcmp (key->key, buff, len) )
+		return diff;
+
+	return (int)key->len - (int)max;
+}
+
+#ifdef HAT_MERGE
+//	load the run's key at offset tst,
+//	or mark it run out past either end
+
+void hat_run_load (HatRun *run, ushort tst)
+{
+HatBase *base = run->base;
+
+	if( run->idx >= base->cnt ) {
+	  run->key = NULL;
+	  return;
+	}
+
+	tst += HAT_tag;
+	run->len = base->keys[tst++];
+
+	if( run->len & 0x80 )
+		run->len &= 0x7f, run->len += base->keys[tst++] << 7;
+
+	run->key = base->keys + tst;
+	run->off = tst + run->len;
+}
+
+//	move a run to the given key index, scanning
+//	from the front, or -1 to run out before it
+
+void hat_run_at (HatRun *run, ushort idx)
+{
+	run->idx = 0;
+	hat_run_load (run, 0);
+
+	if( idx >= run->base->cnt ) {
+	  run->idx = idx;
+	  run->key = NULL;
+	  return;
+	}
+
+	while( run->idx < idx )
+	  run->idx++, hat_run_load (run, run->off);
+}
+
+//	does run a beat run b in the cursor direction?
+//	a run that has run out always loses
+
+int hat_beats (HatCursor *cursor, uint a, uint b)
+{
+HatRun *x = cursor->runs + a, *y = cursor->runs + b;
+int diff;
+
+	if( !y->key )
+		return 1;
+	if( !x->key )
+		return 0;
+
+	if( !(diff = memcmp (x->key, y->key, x->len < y->len ? x->len : y->len)) )
+		diff = (int)x->len - (int)y->len;
+
+	return cursor->dir > 0 ? diff < 0 : diff > 0;
+}
+
+//	build the loser tree below a node, leaving
+//	each match's loser in its node, and return
+//	the winning run.  Run n is leaf nrun + n.
+
+uint hat_play (HatCursor *cursor, uint node)
+{
+uint left, right;
+
+	if( node >= cursor->nrun )
+		return node - cursor->nrun;
+
+	left = hat_play (cursor, 2 * node);
+	right = hat_play (cursor, 2 * node + 1);
+
+	if( hat_beats (cursor, left, right) )
+		return cursor->tree[node] = right, left;
+
+	return cursor->tree[node] = left, right;
+}
+
+//	replay the matches of the winning run
+//	after it has moved on to its next key
+
+void hat_replay (HatCursor *cursor)
+{
+uint win = cursor->tree[0], node, swap;
+
+	for( node = (win + cursor->nrun) / 2; node; node /= 2 )
+	  if( hat_beats (cursor, cursor->tree[node], win) )
+		swap = cursor->tree[node], cursor->tree[node] = win, win = swap;
+
+	cursor->tree[0] = win;
+}
+
+//	start merging the runs in the given direction,
+//	from the first key >= given key (or > it with
+//	skip), the last key < given key (or <= it with
+//	skip), or the end of each run for a NULL key.
+//	Return the count of keys ahead of the winner.
+
+uint hat_merge (HatCursor *cursor, uchar *buff, uint max, int dir, int skip)
+{
+uint idx, rank = 0;
+HatRun *run;
+int diff;
+
+	for( idx = 0; idx < cursor->nrun; idx++ ) {
+	  run = cursor->runs + idx;
+
+	  if( !buff ) {
+		hat_run_at (run, dir > 0 ? 0 : run->base->cnt - 1);
+		continue;
+	  }
+
+	  for( hat_run_at (run, 0); run->key; run->idx++, hat_run_load (run, run->off) ) {
+		if( !(diff = memcmp (run->key, buff, run->len < max ? run->len : max)) )
+		  diff = (int)run->len - (int)max;
+		if( diff >= skip )
+		  break;
+	  }
+
+	  rank += run->idx;
+
+	  if( dir < 0 )
+		hat_run_at (run, run->idx - 1);
+	}
+
+	cursor->dir = dir;
+
+	if( cursor->nrun )
+		cursor->tree[0] = hat_play (cursor, 1);
+
+	return rank;
+}
+
+//	step the merge to the next key in the given
+//	direction, turning it round on the current key
+
+void hat_merge_step (HatCursor *cursor, int dir)
+{
+HatRun *run = cursor->runs + cursor->tree[0];
+
+	if( cursor->dir != dir ) {
+	  hat_merge (cursor, run->key, run->len, dir, dir > 0);
+	  return;
+	}
+
+	if( dir > 0 )
+	  run->idx++, hat_run_load (run, run->off);
+	else
+	  hat_run_at (run, run->idx - 1);
+
+	hat_replay (cursor);
+}
+#endif
+
+//	binary search the sorted keys for the first
+//	key >= given key, in byte order with shorter
+//	keys first when one is a prefix of the other.
+//	Unsorted keys are instead partitioned about
+//	the given key, and only the next run sorted.
+
+int hat_greater (HatCursor *cursor, uchar *buff, uint max)
+{
+uint low = 0;
+#ifndef HAT_MERGE
+uint high = cursor->cnt, mid;
+HatSort swap;
+#endif
+
+#ifdef HAT_MERGE
+  low = hat_merge (cursor, buff, max, 1, 0);
+#else
+  if( cursor->sorted < cursor->cnt ) {
+	for( mid = 0; mid < cursor->cnt; mid++ )
+	  if( hat_seekcmp (cursor->keys + mid, buff, max) < 0 )
+		swap = cursor->keys[low], cursor->keys[low++] = cursor->keys[mid], cursor->keys[mid] = swap;
+
+	cursor->low = cursor->sorted = low;
+
+	if( low < cursor->cnt )
+		hat_extend (cursor);
+  } else
+	while( low < high ) {
+	  mid = low + (high - low) / 2;
+
+	  if( hat_seekcmp (cursor->keys + mid, buff, max) < 0 )
+		low = mid + 1;
+	  else
+		high = mid;
+	}
+#endif
+
+  if( (cursor->idx = low) < cursor->cnt )
+	return 1;
+
+  //	given key > every key in bucket
+
+  return hat_nxt (cursor);
+}
+
+//	open new sort cursor into collection
+
+//	the key array starts empty, and grows to
+//	the largest node the cursor sorts
+
+void *hat_cursor (Hat *hat)
+{
+HatCursor *cursor;
+
+	if( !(cursor = malloc (sizeof(HatCursor))) )
+		hat_abort ("Out of virtual memory");
+
+	memset (cursor, 0, sizeof(HatCursor));
+
+	cursor->next[0] = (HatSlot)hat->root;
+	cursor->aux = hat->aux;
+	cursor->maxroot = 1;
+#ifdef HAT_ORDER
+	cursor->mapped = hat->main->image != NULL;
+#endif
+
+	for( cursor->rootlvl = 0; cursor->rootlvl < hat->bootlvl; cursor->rootlvl++ )
+		cursor->maxroot *= HAT_fanout;
+
+	cursor->rootmax = cursor->maxroot;
+	return cursor;
+}
+
+//	put a cursor back to its just opened state,
+//	keeping its key array for the next start
+
+void hat_cursor_reset (HatCursor *cursor)
+{
+	cursor->cnt = cursor->idx = 0;
+	cursor->low = cursor->sorted = 0;
+	cursor->top = 0;
+	cursor->rootscan = 0;
+	cursor->rootmin = 0;
+	cursor->rootmax = cursor->maxroot;
+	cursor->range = 0;
+}
+
+//	sort at most limit keys of a bucket at a time,
+//	for cursors that read a few keys from a seek
+
+void hat_cursor_limit (HatCursor *cursor, uint limit)
+{
+	cursor->limit = limit;
+}
+
+void hat_cursor_close (HatCursor *cursor)
+{
+#ifdef HAT_MERGE
+	free (cursor->runs);
+	free (cursor->tree);
+#endif
+	free (cursor->keys);
+	free (cursor);
+}
+
+//	push the child taken from the root slot or the radix
+//	slot ch at the top of the cursor stack, extending the
+//	cursor's key path by its bytes
+
+void hat_push (HatCursor *cursor, int ch, HatSlot next)
+{
+uint off = cursor->depth[cursor->top], div;
+
+	if( cursor->top ) {
+	  cursor->scan[cursor->top] = ch;
+
+	  if( ch ) // skip end-of-key slot
+		cursor->path[off++] = ch - HAT_binary;
+	} else
+	  for( div = cursor->maxroot; div /= HAT_fanout; )
+		if( ch = cursor->rootscan / div % HAT_fanout )
+		  cursor->path[off++] = ch - HAT_binary;
+
+	cursor->next[++cursor->top] = next;
+	cursor->depth[cursor->top] = off;
+}
+
+//	a cursor that fails to start is left
+//	open, to be started again or closed
+
+void *hat_start (HatCursor *cursor, uchar *buff, uint max)
+{
+HatSlot *root, next;
+uint off = 0;
+uint idx;
+int ch;
 
 	if( max > 255 )
 		max = 255;
 
+	//	forget the last node the cursor was on,
+	//	as hat_nxt carries on from its index
+
+	hat_cursor_reset (cursor);
+
 	for( idx = 0; idx < cursor->rootlvl; idx++ ) {
-		cursor->rootscan *= 128;
+		cursor->rootscan *= HAT_fanout;
 		if( off < max )
-			cursor->rootscan += buff[off++];
+			cursor->rootscan += buff[off++] + HAT_binary;
 	}
 
 	//	find first root >= given key
@@ -507,41 +1415,36 @@ uchar ch;
 	cursor->top = 0;
 
 	if( next = root[cursor->rootscan] ) {
-	  cursor->next[++cursor->top] = next;
+	  hat_push (cursor, 0, next);
 
-loop:
-	  if( (cursor->next[cursor->top] & HAT_type) == HAT_radix ) {
+	  while( HAT_isradix (cursor->next[cursor->top]) ) {
 		if( max > off )
-			ch = buff[off++];
+			idx = buff[off++] + HAT_binary;
 		else
-			ch = 0;
+			idx = 0;
 
-		radix = (HatSlot *)(cursor->next[cursor->top] & HAT_mask);
+		//	given key > every key in radix node?
 
-		while( ch < 128 )
-		  if( radix[ch] ) {
-			cursor->scan[cursor->top] = ch;
-		    cursor->next[++cursor->top] = radix[ch];
-			goto loop;
-		  } else
-			max = 0, ch++;
+		if( (ch = hat_radix_scan (cursor->next[cursor->top], idx, 1, &next)) < 0 ) {
+		  if( hat_nxt (cursor) )
+			return cursor;
 
-		//	given key > every key
+		  return NULL;
+		}
 
-		if( hat_nxt (cursor) )
-			return cursor;
+		//	past the given key, take the first key below
 
-		free (cursor);
-		return NULL;
+		if( ch > idx )
+			max = off;
+
+		hat_push (cursor, ch, next);
 	  }
 
-	  hat_sort (cursor);
-  	  cursor->idx = 0;
+	  hat_sort (cursor, 1);
 
 	  if( hat_greater (cursor, buff + off, max - off) )
 	 	return cursor;
 
-	  free (cursor);
 	  return NULL;
 	}
 
@@ -552,15 +1455,52 @@ loop:
 	if( hat_nxt (cursor) )
 		return cursor;
 
-	free (cursor);
 	return NULL;
 }
 
+//	descend from the radix node at the top of the
+//	cursor stack to its first (dir > 0) or last
+//	(dir < 0) key, returning zero if it is empty
+
+int hat_descend (HatCursor *cursor, int dir)
+{
+HatSlot next;
+int ch;
+
+	while( HAT_isradix (cursor->next[cursor->top]) ) {
+	  if( (ch = hat_radix_scan (cursor->next[cursor->top], dir > 0 ? 0 : HAT_fanout - 1, dir, &next)) < 0 )
+		return 0;
+
+	  hat_push (cursor, ch, next);
+	}
+
+	hat_sort (cursor, dir > 0);
+#ifdef HAT_MERGE
+	hat_merge (cursor, NULL, 0, dir, 0);
+#endif
+
+	if( dir > 0 )
+	  cursor->idx = 0;
+	else
+	  cursor->idx = cursor->cnt - 1;
+
+	if( cursor->sorted < cursor->cnt )
+	  hat_extend (cursor);
+
+	return 1;
+}
+
 //	return user area slot address at given cursor location
 
 void *hat_slot (HatCursor *cursor)
 {
+#ifdef HAT_MERGE
+HatRun *run = cursor->runs + cursor->tree[0];
+
+	return (uchar *)run->base + HatSize[run->base->type] - (run->idx + 1) * cursor->aux;
+#else
 	return cursor->keys[cursor->idx].slot;
+#endif
 }
 
 //	advance cursor to next key
@@ -568,55 +1508,53 @@ void *hat_slot (HatCursor *cursor)
 
 int hat_nxt (HatCursor *cursor)
 {
-HatSlot *radix;
-uint idx, max;
-uchar ch;
+HatSlot *root, next;
+uint idx;
+int ch;
 
 	//  any keys left in current sorted array?
+	//	sort the next run of a partly sorted one
 
-	if( ++cursor->idx < cursor->cnt )
-		return 1;
+	if( ++cursor->idx < cursor->cnt ) {
+#ifdef HAT_MERGE
+	  hat_merge_step (cursor, 1);
+#else
+	  if( cursor->idx == cursor->sorted )
+		hat_extend (cursor);
+#endif
+	  return 1;
+	}
 
 	//  move thru radix nodes
 	//	slot zero is the triple root
 
   while( --cursor->top >= 0 ) {
-	radix = (HatSlot *)(cursor->next[cursor->top] & HAT_mask);
+	if( cursor->top ) {
+	  if( (ch = hat_radix_scan (cursor->next[cursor->top], cursor->scan[cursor->top] + 1, 1, &next)) < 0 )
+		continue;
+	} else {
+	  root = (HatSlot *)(cursor->next[0]);
+	  idx = cursor->rootscan;
 
-	if( !cursor->top )
-		max = cursor->maxroot;
-	else
-		max = 128;
+	  while( ++idx < cursor->rootmax )
+		if( next = root[idx] )
+		  break;
 
-	if( cursor->top )
-		idx = cursor->scan[cursor->top];
-	else
-		idx = cursor->rootscan;
+	  if( idx >= cursor->rootmax )
+		continue;
 
-	while( ++idx < max )
-	  if( radix[idx] ) {
-		if( cursor->top )
-			cursor->scan[cursor->top] = idx;
-		else
-			cursor->rootscan = idx;
+	  cursor->rootscan = idx;
+	  ch = 0;	// root path comes from rootscan
+	}
 
-		cursor->next[++cursor->top] = radix[idx];
-loop:
-		if( (cursor->next[cursor->top] & HAT_type) == HAT_radix ) {
-		  radix = (HatSlot *)(cursor->next[cursor->top] & HAT_mask);
-
-		  for( ch = 0; ch < 128; ch++ )
-		   if( radix[ch] ) {
-			cursor->scan[cursor->top] = ch;
-		    cursor->next[++cursor->top] = radix[ch];
-			goto loop;
-		   }
-		}
+	hat_push (cursor, ch, next);
 
-		hat_sort (cursor);
-  	    cursor->idx = 0;
+	if( hat_descend (cursor, 1) )
 		return 1;
-	  }
+
+	//	skip over an empty radix node
+
+	cursor->scan[cursor->top++] = HAT_fanout - 1;
   }
 
   return 0;
@@ -627,50 +1565,56 @@ loop:
 
 int hat_prv (HatCursor *cursor)
 {
-HatSlot *radix;
-uint idx, max;
-uchar ch;
+HatSlot *root, next;
+uint idx;
+int ch;
 
 	//  any keys left in current sorted array?
+	//	the keys a partial seek passed over are
+	//	sorted the first time the cursor backs up
 
-	if( cursor->idx )
-		return cursor->idx--, 1;
+	if( cursor->idx ) {
+#ifdef HAT_MERGE
+	  hat_merge_step (cursor, -1);
+#else
+	  if( cursor->idx == cursor->low ) {
+		hat_qsort (cursor->keys, cursor->low, 0);
+		cursor->low = 0;
+	  }
+#endif
+	  return cursor->idx--, 1;
+	}
 
 	//  move down thru radix nodes
 	//	slot zero is the triple root
 
   while( --cursor->top >= 0 ) {
-	radix = (HatSlot *)(cursor->next[cursor->top] & HAT_mask);
+	if( cursor->top ) {
+	  if( (ch = hat_radix_scan (cursor->next[cursor->top], cursor->scan[cursor->top] - 1, -1, &next)) < 0 )
+		continue;
+	} else {
+	  root = (HatSlot *)(cursor->next[0]);
+	  idx = cursor->rootscan;
 
-	if( cursor->top )
-		idx = cursor->scan[cursor->top];
-	else
-		idx = cursor->rootscan;
+	  while( idx-- > cursor->rootmin )
+		if( next = root[idx] )
+		  break;
 
-	while( idx-- )
-	  if( radix[idx] ) {
-		if( cursor->top )
-			cursor->scan[cursor->top] = idx;
-		else
-			cursor->rootscan = idx;
+	  if( idx == cursor->rootmin - 1 )
+		continue;
 
-		cursor->next[++cursor->top] = radix[idx];
-loop:
-		if( (cursor->next[cursor->top] & HAT_type) == HAT_radix ) {
-		  radix = (HatSlot *)(cursor->next[cursor->top] & HAT_mask);
-
-		  for( ch = 128; ch-- > 0; )
-		   if( radix[ch] ) {
-			cursor->scan[cursor->top] = ch;
-		    cursor->next[++cursor->top] = radix[ch];
-			goto loop;
-		   }
-		}
+	  cursor->rootscan = idx;
+	  ch = 0;	// root path comes from rootscan
+	}
+
+	hat_push (cursor, ch, next);
 
-		hat_sort (cursor);
-		cursor->idx = cursor->cnt - 1;
+	if( hat_descend (cursor, -1) )
 		return 1;
-	  }
+
+	//	skip over an empty radix node
+
+	cursor->scan[cursor->top++] = 0;
   }
 
   return 0;
@@ -681,50 +1625,45 @@ loop:
 
 int hat_last (HatCursor *cursor)
 {
-HatSlot *radix, next, *root;
-uint idx, max;
-uchar ch;
+	cursor->rootscan = cursor->rootmax;
+	cursor->top = 1;
+	cursor->idx = 0;
 
-	//	find last root
-	//	or return if tree is empty
+	return hat_prv (cursor);
+}
 
-	cursor->rootscan = cursor->maxroot;
-	root = (HatSlot *)(cursor->next[0]);
-	cursor->top = 0;
+//	advance cursor to first key in the trie
+//	returning false if tree is empty
 
-	while( cursor->rootscan )
-	 if( next = root[--cursor->rootscan] )
-	  break;
-	 else if( !cursor->rootscan )
-	  return 0;
-	  
-	cursor->next[++cursor->top] = next;
+int hat_first (HatCursor *cursor)
+{
+	cursor->rootscan = cursor->rootmin - 1;
+	cursor->top = 1;
+	cursor->idx = cursor->cnt = 0;
 
-loop:
-	if( (cursor->next[cursor->top] & HAT_type) == HAT_radix ) {
-		radix = (HatSlot *)(cursor->next[cursor->top] & HAT_mask);
-		ch = 128;
-
-		while( ch-- )
-		  if( radix[ch] ) {
-			cursor->scan[cursor->top] = ch;
-		    cursor->next[++cursor->top] = radix[ch];
-			goto loop;
-		  }
-	}
+	return hat_nxt (cursor);
+}
 
-	hat_sort (cursor);
-  	cursor->idx = cursor->cnt - 1;
-	return 1;
+//	return the rest of the key at the current
+//	cursor location, below its path
+
+uchar *hat_rest (HatCursor *cursor, uint *len)
+{
+#ifdef HAT_MERGE
+	*len = cursor->runs[cursor->tree[0]].len;
+	return cursor->runs[cursor->tree[0]].key;
+#else
+	*len = cursor->keys[cursor->idx].len;
+	return cursor->keys[cursor->idx].key;
+#endif
 }
 
 //	return key at current cursor location
 
 uint hat_key (HatCursor *cursor, uchar *buff, uint max)
 {
-int idx, scan, len;
-uchar *key, ch;
-uint off = 0;
+uint off, len;
+uchar *key;
 
 	max--;	// leave room for terminator
 
@@ -736,26 +1675,12 @@ uint off = 0;
 	  return 0;
 	}
 
-	//	fill in from triple root
-	//	and cascaded radix nodes
-
-	for( idx = 0; idx < cursor->top; idx++ )
-	  if( !idx ) {
-		for( scan = cursor->rootlvl; scan--; )
-		  if( ch = (cursor->rootscan >> scan * 7) & 0x7F )
-	        if( off < max )
-		      buff[off++] = ch;
-	  } else if( off < max )
-		  if( ch = cursor->scan[idx] ) // skip slot zero
-			buff[off++] = ch;
+	//	copy the path kept by the cursor, then pull
+	//	rest of key from current entry in sorted array
 
-	//	pull rest of key from current entry in sorted array
-
-	key = cursor->keys[cursor->idx].key;
-	len = *key++;
-
-	if( len & 0x80 )
-		len &= 0x7f, len += *key++ << 7;
+	off = cursor->depth[cursor->top] < max ? cursor->depth[cursor->top] : max;
+	memcpy (buff, cursor->path, off);
+	key = hat_rest (cursor, &len);
 
 	while( len-- && off < max )
 		buff[off++] = *key++;
@@ -764,43 +1689,378 @@ uint off = 0;
 	return off;
 }
 
-//	allocate hat node
+//	return the key at the current cursor location
+//	without copying it, as the path bytes kept by
+//	the cursor and the rest in the current node.
+//	Returns the whole key length, zero at EOF.
 
-void *hat_alloc (Hat *hat, uint type)
+uint hat_key_parts (HatCursor *cursor, uchar **prefix, uint *plen, uchar **suffix, uint *slen)
 {
-uint amt, idx, round;
-HatSeg *seg;
-void *block;
+	if( cursor->top < 0 ) {
+	  *prefix = *suffix = NULL;
+	  *plen = *slen = 0;
+	  return 0;
+	}
 
-	amt = HatSize[type];
-	hat->counts[type]++;
+	*prefix = cursor->path;
+	*plen = cursor->depth[cursor->top];
+	*suffix = hat_rest (cursor, slen);
+	return *plen + *slen;
+}
 
-	if( amt & (HAT_cache_line - 1) )
-		amt |= (HAT_cache_line - 1), amt += 1;
+//	compare the key in two parts with a range bound
 
-	//	see if free block is already available
+int hat_boundcmp (uchar *path, uint plen, uchar *key, uint len, uchar *bound, uint blen)
+{
+int diff;
 
-	if( (block = hat->reuse[type]) ) {
-		hat->reuse[type] = *(void **)block;
-		memset (block, 0, amt);
-		return (void *)block;
-	}
+	if( diff = memcmp (path, bound, plen < blen ? plen : blen) )
+		return diff;
 
-	if( hat->seg->next + amt > HAT_seg ) {
-		if( (seg = malloc (HAT_seg)) ) {
-			seg->next = sizeof(*seg);
-			seg->seg = hat->seg;
-			hat->seg = seg;
-			if( round = (HatSlot)seg & (HAT_cache_line - 1) )
-				seg->next += HAT_cache_line - round;
-		} else {
-			hat_abort("Out of virtual memory");
-		}
+	if( plen < blen )
+	  if( diff = memcmp (key, bound + plen, len < blen - plen ? len : blen - plen) )
+		return diff;
 
-		MaxMem += HAT_seg;
-	}
+	return (int)(plen + len) - (int)blen;
+}
 
-	block = (void *)((uchar *)hat->seg + hat->seg->next);
+//	fill a buffer with records of the keys in a range,
+//	one batch per call.  Each record is the key length
+//	in two bytes, low byte first, the key bytes and the
+//	key's aux bytes.  The first call on a new or reset
+//	cursor seeks the range, later calls carry on where
+//	the last one stopped.  A NULL bound leaves that end
+//	of the range open, and a zero limit leaves the record
+//	count open.  Returns the number of records, or zero
+//	once the range is done.  When the buffer will not
+//	hold even the next record, returns minus the bytes
+//	that record needs, and the next call carries on
+//	from it.
+
+int hat_batch (HatCursor *cursor, uchar *lo, uint lolen, uchar *hi, uint hilen, uchar *buff, uint max, uint limit, int dir)
+{
+uint off = 0, cnt = 0, plen, len, size;
+uchar *key, *rec, *bound, *path;
+int diff, found;
+
+	if( cursor->range > 1 )
+		return 0;
+
+	//	position on the first key of the range
+
+	if( !cursor->range ) {
+	  if( dir > 0 )
+		found = lo ? hat_start (cursor, lo, lolen) != NULL : hat_first (cursor);
+	  else if( hi && hat_start (cursor, hi, hilen) )
+		found = hat_prv (cursor);
+	  else
+		found = hat_last (cursor);
+
+	  if( (cursor->range = found ? 1 : 2) > 1 )
+		return 0;
+	}
+
+	while( !limit || cnt < limit ) {
+	  hat_key_parts (cursor, &path, &plen, &key, &len);
+	  size = 2 + plen + len + cursor->aux;
+
+	  //	stop at the far end of the range
+
+	  if( bound = dir > 0 ? hi : lo ) {
+		diff = hat_boundcmp (path, plen, key, len, bound, dir > 0 ? hilen : lolen);
+
+		if( dir > 0 ? diff >= 0 : diff < 0 ) {
+		  cursor->range = 2;
+		  break;
+		}
+	  }
+
+	  if( off + size > max ) {
+		if( !cnt )
+		  return -(int)size;
+		break;
+	  }
+
+	  rec = buff + off;
+	  rec[0] = (plen + len) & 0xff;
+	  rec[1] = (plen + len) >> 8;
+	  memcpy (rec + 2, path, plen);
+	  memcpy (rec + 2 + plen, key, len);
+	  memcpy (rec + 2 + plen + len, hat_slot (cursor), cursor->aux);
+	  off += size;
+	  cnt++;
+
+	  if( dir > 0 ? !hat_nxt (cursor) : !hat_prv (cursor) ) {
+		cursor->range = 2;
+		break;
+	  }
+	}
+
+	return cnt;
+}
+
+int hat_range (HatCursor *cursor, uchar *lo, uint lolen, uchar *hi, uint hilen, uchar *buff, uint max, uint limit)
+{
+	return hat_batch (cursor, lo, lolen, hi, hilen, buff, max, limit, 1);
+}
+
+int hat_range_rev (HatCursor *cursor, uchar *lo, uint lolen, uchar *hi, uint hilen, uchar *buff, uint max, uint limit)
+{
+	return hat_batch (cursor, lo, lolen, hi, hilen, buff, max, limit, -1);
+}
+
+//	prefix scans visit every key starting with a
+//	prefix, following the prefix bytes through the
+//	root and radix levels, and filtering the keys
+//	of the nodes below before sorting the survivors
+
+typedef int (*HatVisit) (void *ctx, uchar *key, uint len, void *slot);
+
+typedef struct {
+	HatVisit visit;		// callback, non-zero return stops the scan
+	void *ctx;			// callback context
+	uchar *prefix;		// prefix bytes
+	uint len;			// prefix length
+	uint aux;			// number of aux bytes per key
+	int sorted;			// visit keys in order
+	int stop;			// callback asked to stop
+	uchar *key;			// key being visited
+	HatSort *keys;		// matching keys of a node
+	uint cnt;			// number of matching keys
+	uint max;			// entries allocated in keys
+	unsigned long long visited;
+} HatScan;
+
+void hat_prefix_visit (HatScan *scan, uint off, uchar *key, uint len, void *slot)
+{
+	memcpy (scan->key + off, key, len);
+	scan->visited++;
+
+	if( scan->visit (scan->ctx, scan->key, off + len, slot) )
+		scan->stop = 1;
+}
+
+//	filter the keys of an array node on the rest of
+//	the prefix, visiting them or saving them to sort
+
+void hat_prefix_array (HatScan *scan, HatSlot node, uint off)
+{
+HatBase *base = (HatBase *)(node & HAT_mask);
+uint need = off < scan->len ? scan->len - off : 0;
+uint size = HatSize[base->type];
+ushort tst = 0, len;
+uchar *key;
+int idx;
+
+  for( idx = 0; idx < base->cnt && !scan->stop; idx++ ) {
+	tst += HAT_tag;
+	len = base->keys[tst++];
+	if( len & 0x80 )
+		len &= 0x7f, len += base->keys[tst++] << 7;
+	key = base->keys + tst;
+	tst += len;
+
+	if( len < need || memcmp (key, scan->prefix + off, need) )
+		continue;
+
+	if( !scan->sorted ) {
+	  hat_prefix_visit (scan, off, key, len, (uchar *)base + size - (idx + 1) * scan->aux);
+	  continue;
+	}
+
+	if( scan->cnt == scan->max ) {
+	  scan->max = scan->max ? 2 * scan->max : 256;
+
+	  if( !(scan->keys = realloc (scan->keys, scan->max * sizeof(HatSort))) )
+		hat_abort ("Out of virtual memory");
+	}
+
+	scan->keys[scan->cnt].slot = (uchar *)base + size - (idx + 1) * scan->aux;
+	scan->keys[scan->cnt].key = key;
+	scan->keys[scan->cnt].len = len;
+	scan->keys[scan->cnt++].word = hat_word (key, len, 0);
+  }
+}
+
+//	visit the matching keys below a node, whose
+//	key bytes up to off are already in the key
+
+void hat_prefix_node (HatScan *scan, HatSlot node, uint off)
+{
+HatSlot *child, next;
+HatBucket *bucket;
+HatPail *pail;
+uint idx;
+int ch;
+
+  if( HAT_isradix (node) ) {
+	if( off < scan->len ) {
+	  if( (child = hat_radix_find (node, scan->prefix[off] + HAT_binary)) && *child ) {
+		scan->key[off] = scan->prefix[off];
+		hat_prefix_node (scan, *child, off + 1);
+	  }
+	  return;
+	}
+
+	//	past the prefix, visit every child in order,
+	//	slot zero holding the keys that end here
+
+	for( ch = 0; !scan->stop && (ch = hat_radix_scan (node, ch, 1, &next)) >= 0; ch++ )
+	  if( ch ) {
+		scan->key[off] = ch - HAT_binary;
+		hat_prefix_node (scan, next, off + 1);
+	  } else
+		hat_prefix_node (scan, next, off);
+
+	return;
+  }
+
+  scan->cnt = 0;
+
+  switch( node & HAT_type ) {
+  case HAT_array:
+	hat_prefix_array (scan, node, off);
+	break;
+
+  case HAT_pail:
+	pail = (HatPail *)(node & HAT_mask);
+
+	for( idx = 0; idx < HatPailMax; idx++ )
+	  if( pail->array[idx] )
+		hat_prefix_array (scan, pail->array[idx], off);
+
+	break;
+
+  case HAT_bucket:
+	bucket = (HatBucket *)(node & HAT_mask);
+
+	for( idx = 0; idx < HatBucketSlots; idx++ )
+	  switch( bucket->slots[idx] & HAT_type ) {
+	  case HAT_array:
+		hat_prefix_array (scan, bucket->slots[idx], off);
+		continue;
+
+	  case HAT_pail:
+		pail = (HatPail *)(bucket->slots[idx] & HAT_mask);
+
+		for( ch = 0; ch < HatPailMax; ch++ )
+		  if( pail->array[ch] )
+			hat_prefix_array (scan, pail->array[ch], off);
+
+		continue;
+	  }
+
+	break;
+  }
+
+  if( !scan->cnt )
+	return;
+
+  hat_qsort (scan->keys, scan->cnt, 0);
+
+  for( idx = 0; idx < scan->cnt && !scan->stop; idx++ )
+	hat_prefix_visit (scan, off, scan->keys[idx].key, scan->keys[idx].len, scan->keys[idx].slot);
+}
+
+//	visit the keys starting with the given prefix,
+//	in key order when sorted is set, returning the
+//	number of keys visited
+
+unsigned long long hat_prefix (Hat *hat, uchar *prefix, uint len, int sorted, HatVisit visit, void *ctx)
+{
+uint first = 0, span = 1, maxroot = 1, slot, div, off, idx;
+HatSlot *root = hat->root;
+HatScan scan[1];
+int ch;
+
+	memset (scan, 0, sizeof(HatScan));
+	scan->visit = visit;
+	scan->ctx = ctx;
+	scan->prefix = prefix;
+	scan->len = len;
+	scan->aux = hat->aux;
+	scan->sorted = sorted;
+
+	if( !(scan->key = malloc (65536)) )
+		hat_abort ("Out of virtual memory");
+
+	//	root slots whose first digits are the
+	//	prefix bytes, and any digits after them
+
+	for( idx = 0; idx < hat->bootlvl; idx++ ) {
+	  if( idx < len )
+		first = first * HAT_fanout + prefix[idx] + HAT_binary;
+	  else
+		first *= HAT_fanout, span *= HAT_fanout;
+
+	  maxroot *= HAT_fanout;
+	}
+
+	for( slot = first; slot < first + span && !scan->stop; slot++ ) {
+	  if( !root[slot] )
+		continue;
+
+	  off = 0;
+
+	  for( div = maxroot; div /= HAT_fanout; )
+		if( ch = slot / div % HAT_fanout )
+		  scan->key[off++] = ch - HAT_binary;
+
+	  hat_prefix_node (scan, root[slot], off);
+	}
+
+	free (scan->keys);
+	free (scan->key);
+	return scan->visited;
+}
+
+unsigned long long hat_prefix_scan (Hat *hat, uchar *prefix, uint len, HatVisit visit, void *ctx)
+{
+	return hat_prefix (hat, prefix, len, 1, visit, ctx);
+}
+
+unsigned long long hat_prefix_walk (Hat *hat, uchar *prefix, uint len, HatVisit visit, void *ctx)
+{
+	return hat_prefix (hat, prefix, len, 0, visit, ctx);
+}
+
+//	allocate hat node
+
+void *hat_alloc (Hat *hat, uint type)
+{
+uint amt, idx, round;
+HatSeg *seg;
+void *block;
+
+	amt = HatSize[type];
+	hat->counts[type]++;
+
+	if( amt & (HAT_cache_line - 1) )
+		amt |= (HAT_cache_line - 1), amt += 1;
+
+	//	see if free block is already available
+
+	if( (block = hat->reuse[type]) ) {
+		hat->reuse[type] = *(void **)block;
+		memset (block, 0, amt);
+		return (void *)block;
+	}
+
+	if( hat->seg->next + amt > HAT_seg ) {
+		if( (seg = malloc (HAT_seg)) ) {
+			seg->next = sizeof(*seg);
+			seg->seg = hat->seg;
+			hat->seg = seg;
+			if( round = (HatSlot)seg & (HAT_cache_line - 1) )
+				seg->next += HAT_cache_line - round;
+		} else {
+			hat_abort("Out of virtual memory");
+		}
+
+		hat_add (&MaxMem, HAT_seg);
+	}
+
+	block = (void *)((uchar *)hat->seg + hat->seg->next);
 	hat->seg->next += amt;
 	memset (block, 0, amt);
 
@@ -827,7 +2087,7 @@ uint round;
 			hat_abort("Out of virtual memory");
 		}
 	
-		MaxMem += HAT_seg;
+		hat_add (&MaxMem, HAT_seg);
 	}
 
 	block = (void *)((uchar *)hat->seg + hat->seg->next);
@@ -837,898 +2097,3700 @@ uint round;
 	return block;
 }
 
-void hat_free (Hat *hat, void *block, int type)
+//	drop a node's cached sorted order
+
+#ifdef HAT_ORDER
+void hat_unorder (HatOrder **order)
+{
+	if( *order )
+		free (*order), *order = NULL;
+}
+#else
+	#define hat_unorder(order) ((void)0)
+#endif
+
+//	put block onto its reuse list
+
+void hat_release (Hat *hat, void *block, int type)
 {
 	*((void **)(block)) = hat->reuse[type];
 	hat->reuse[type] = (void **)block;
+}
+
+//	under HAT_EBR a freed block may still be read by
+//	readers that entered before it was unlinked, so
+//	it waits on the retire list for hat_reclaim.  It
+//	is stamped with the epoch there, once the writer's
+//	operation has unlinked it.
+
+void hat_free (Hat *hat, void *block, int type)
+{
 	hat->counts[type]--;
-	return;
+
+	if( type == HAT_bucket )
+		hat_unorder (&((HatBucket *)block)->order);
+	else if( type == HAT_pail )
+		hat_unorder (&((HatPail *)block)->order);
+#ifdef HAT_EBR
+	if( hat->retired == hat->retiremax ) {
+		hat->retiremax = hat->retiremax ? hat->retiremax * 2 : HAT_reclaim * 2;
+		if( !(hat->retire = realloc (hat->retire, hat->retiremax * sizeof(HatRetire))) )
+			hat_abort ("Out of virtual memory");
+	}
+
+	hat->retire[hat->retired].block = block;
+	hat->retire[hat->retired].type = type;
+	hat->retire[hat->retired++].epoch = 0;
+#else
+	hat_release (hat, block, type);
+#endif
 }
-		
-//	open hat object
-//	call with number of radix levels to boot into root
-//	and number of auxilliary user bytes to assign to each key
 
-void *hat_open (int boot, int aux)
-{
-uint amt, size = HAT_slot_size, round;
-HatSeg *seg;
-Hat *hat;
-int idx;
+#ifdef HAT_EBR
+//	called by a writer between its operations, when
+//	every block it retired has been unlinked: stamp
+//	them with the epoch, advance it, and reuse the
+//	blocks retired before the oldest epoch a reader
+//	is still in.  Retire lists are kept per handle,
+//	the epoch and readers by the main hat.
+
+void hat_reclaim (Hat *hat)
+{
+unsigned long long epoch, oldest;
+Hat *main = hat->main;
+uint idx, cnt;
+
+	epoch = __atomic_fetch_add (&main->epoch, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+	oldest = epoch + 1;
+
+	for( idx = hat->retired; idx--; )
+	  if( !hat->retire[idx].epoch )
+		hat->retire[idx].epoch = epoch;
+	  else
+		break;
+
+	for( idx = 0; idx < HAT_readers; idx++ )
+	  if( epoch = __atomic_load_n (&main->readers[idx].epoch, __ATOMIC_SEQ_CST) )
+		if( epoch < oldest )
+		  oldest = epoch;
+
+	for( cnt = 0; cnt < hat->retired && hat->retire[cnt].epoch < oldest; cnt++ )
+	  hat_release (hat, hat->retire[cnt].block, hat->retire[cnt].type);
+
+	memmove (hat->retire, hat->retire + cnt, (hat->retired - cnt) * sizeof(HatRetire));
+	hat->retired -= cnt;
+}
+
+//	assign a reader slot to the calling thread,
+//	returning its number or -1 if none are free
+
+int hat_reader (Hat *hat)
+{
+uint idx, free;
+
+	hat = hat->main;
+
+	for( idx = 0; idx < HAT_readers; idx++ )
+	  if( free = 0, __atomic_compare_exchange_n (&hat->readers[idx].used, &free, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) )
+		return idx;
+
+	return -1;
+}
+
+//	give up a reader slot
+
+void hat_reader_close (Hat *hat, int reader)
+{
+	hat = hat->main;
+	__atomic_store_n (&hat->readers[reader].used, 0, __ATOMIC_RELEASE);
+}
+
+//	mark a reader as inside the trie, nodes it can
+//	reach are not reused until it calls hat_exit
+
+void hat_enter (Hat *hat, int reader)
+{
+	hat = hat->main;
+	__atomic_store_n (&hat->readers[reader].epoch, __atomic_load_n (&hat->epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+void hat_exit (Hat *hat, int reader)
+{
+	hat = hat->main;
+	__atomic_store_n (&hat->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+#endif
+
+//	allocation class of a radix node type
+
+uint hat_radix_class (uint type)
+{
+	switch( type ) {
+	case HAT_radix4:
+	  return HAT_node4;
+	case HAT_radix16:
+	  return HAT_node16;
+	case HAT_radix48:
+	  return HAT_node48;
+	}
+
+	return HAT_radix;
+}
+
+//	add an empty child slot for key index ch to a
+//	radix node known to have room for it
+
+HatSlot *hat_radix_add (HatSlot node, uint ch)
+{
+HatRadix4 *radix4;
+HatRadix16 *radix16;
+HatRadix48 *radix48;
+uint idx;
+
+  switch( node & HAT_type ) {
+  case HAT_radix4:
+	radix4 = (HatRadix4 *)(node & HAT_mask);
+
+	for( idx = radix4->cnt; idx && radix4->keys[idx - 1] > ch; idx-- )
+	  radix4->keys[idx] = radix4->keys[idx - 1], radix4->slots[idx] = radix4->slots[idx - 1];
+
+	radix4->keys[idx] = ch;
+	radix4->slots[idx] = 0;
+	radix4->cnt++;
+	return radix4->slots + idx;
+
+  case HAT_radix16:
+	radix16 = (HatRadix16 *)(node & HAT_mask);
+
+	for( idx = radix16->cnt; idx && radix16->keys[idx - 1] > ch; idx-- )
+	  radix16->keys[idx] = radix16->keys[idx - 1], radix16->slots[idx] = radix16->slots[idx - 1];
+
+	radix16->keys[idx] = ch;
+	radix16->slots[idx] = 0;
+	radix16->cnt++;
+	return radix16->slots + idx;
+
+  case HAT_radix48:
+	radix48 = (HatRadix48 *)(node & HAT_mask);
+
+	//  the slot is cleared before the index
+	//  to it is published for readers
+
+	radix48->slots[radix48->cnt] = 0;
+	hat_publish (&radix48->index[ch], radix48->cnt + 1);
+	return radix48->slots + radix48->cnt++;
+  }
+
+  return (HatSlot *)(node & HAT_mask) + ch;
+}
+
+//	build a radix node of the given type holding
+//	the children of node, less the one for key
+//	index skip
+
+HatSlot hat_radix_copy (Hat *hat, HatSlot node, uint type, int skip)
+{
+HatSlot copy, child;
+int ch;
+
+	copy = (HatSlot)hat_alloc (hat, hat_radix_class (type)) | type;
+
+	for( ch = 0; (ch = hat_radix_scan (node, ch, 1, &child)) >= 0; ch++ )
+	  if( ch != skip )
+		*hat_radix_add (copy, ch) = child;
+
+	*hat_radix_count (copy) = *hat_radix_count (node);
+	return copy;
+}
+
+//	return the child slot for key index ch in the radix
+//	node held by parent, adding an empty one if needed.
+//	Full nodes are replaced by the next larger type.
+
+//	Under HAT_EBR the sorted 4 and 16 way nodes are
+//	copied rather than shifted in place, so readers
+//	never see a half inserted key.
+
+HatSlot *hat_radix_slot (Hat *hat, HatSlot *parent, uint ch)
+{
+HatSlot *slot, node = *parent;
+uint type = node & HAT_type;
+uint cnt;
+
+  if( slot = hat_radix_find (node, ch) )
+	return slot;
+
+  switch( type ) {
+  case HAT_radix4:
+	cnt = ((HatRadix4 *)(node & HAT_mask))->cnt;
+
+	if( cnt == 4 )
+	  type = HAT_radix16;
+	else if( !HAT_ebr )
+	  return hat_radix_add (node, ch);
+
+	break;
+
+  case HAT_radix16:
+	cnt = ((HatRadix16 *)(node & HAT_mask))->cnt;
+
+	if( cnt == 16 )
+	  type = HAT_radix48;
+	else if( !HAT_ebr )
+	  return hat_radix_add (node, ch);
+
+	break;
+
+  case HAT_radix48:
+	cnt = ((HatRadix48 *)(node & HAT_mask))->cnt;
+
+	if( cnt == 48 )
+	  type = HAT_radix;
+	else
+	  return hat_radix_add (node, ch);
+  }
+
+  node = hat_radix_copy (hat, *parent, type, -1);
+  slot = hat_radix_add (node, ch);
+
+  hat_free (hat, (void *)(*parent & HAT_mask), hat_radix_class (*parent & HAT_type));
+  hat_publish (parent, node);
+  return slot;
+}
+
+//	remove the emptied child slot for key index ch
+//	from the radix node in parent, by replacing the
+//	node with a copy, of the next smaller type when
+//	few children remain
+
+void hat_radix_remove (Hat *hat, HatSlot *parent, uint ch)
+{
+HatSlot child, node = *parent;
+uint type = node & HAT_type;
+int cnt, idx;
+
+  switch( type ) {
+  case HAT_radix4:
+	break;
+
+  case HAT_radix16:
+	if( ((HatRadix16 *)(node & HAT_mask))->cnt <= 4 )
+	  type = HAT_radix4;
+	break;
+
+  case HAT_radix48:
+	if( ((HatRadix48 *)(node & HAT_mask))->cnt <= 13 )
+	  type = HAT_radix16;
+	break;
+
+  default:
+	for( cnt = idx = 0; (idx = hat_radix_scan (node, idx, 1, &child)) >= 0; idx++ )
+	  cnt++;
+
+	if( cnt <= 40 )
+	  type = HAT_radix48;
+  }
+
+  node = hat_radix_copy (hat, *parent, type, ch);
+
+  hat_free (hat, (void *)(*parent & HAT_mask), hat_radix_class (*parent & HAT_type));
+  hat_publish (parent, node);
+}
+
+//	free a node and everything below it
+
+void hat_free_node (Hat *hat, HatSlot node)
+{
+HatBucket *bucket;
+HatBase *base;
+HatPail *pail;
+HatSlot child;
+uint idx;
+int ch;
+
+  if( !node )
+	return;
+
+  switch( node & HAT_type ) {
+  case HAT_array:
+	base = (HatBase *)(node & HAT_mask);
+	hat_free (hat, base, base->type);
+	return;
+
+  case HAT_pail:
+	pail = (HatPail *)(node & HAT_mask);
+
+	for( idx = 0; idx < HatPailMax; idx++ )
+	  if( pail->array[idx] )
+		hat_free_node (hat, pail->array[idx]);
+
+	hat_free (hat, pail, HAT_pail);
+	return;
+
+  case HAT_bucket:
+	bucket = (HatBucket *)(node & HAT_mask);
+
+	for( idx = 0; idx < HatBucketSlots; idx++ )
+	  if( bucket->slots[idx] )
+		hat_free_node (hat, bucket->slots[idx]);
+
+	hat_free (hat, bucket, HAT_bucket);
+	return;
+  }
+
+  for( ch = 0; (ch = hat_radix_scan (node, ch, 1, &child)) >= 0; ch++ )
+	hat_free_node (hat, child);
+
+  hat_free (hat, (void *)(node & HAT_mask), hat_radix_class (node & HAT_type));
+}
+
+#ifdef HAT_ORDER
+//	free the cached orders below a node, for hat_close,
+//	leaving the nodes and their counts alone
+
+void hat_free_orders (HatSlot node)
+{
+HatBucket *bucket;
+HatSlot child;
+uint idx;
+int ch;
+
+  switch( node & HAT_type ) {
+  case HAT_array:
+	return;
+
+  case HAT_pail:
+	hat_unorder (&((HatPail *)(node & HAT_mask))->order);
+	return;
+
+  case HAT_bucket:
+	bucket = (HatBucket *)(node & HAT_mask);
+
+	for( idx = 0; idx < HatBucketSlots; idx++ )
+	  if( bucket->slots[idx] )
+		hat_free_orders (bucket->slots[idx]);
+
+	hat_unorder (&bucket->order);
+	return;
+  }
+
+  for( ch = 0; (ch = hat_radix_scan (node, ch, 1, &child)) >= 0; ch++ )
+	hat_free_orders (child);
+}
+#endif
+
+//	open hat object
+//	call with number of radix levels to boot into root
+//	and number of auxilliary user bytes to assign to each key
+
+void *hat_open (int boot, int aux)
+{
+uint amt, size = HAT_slot_size, round;
+HatSeg *seg;
+Hat *hat;
+int idx;
+
+	for( idx = 0; idx < boot; idx++ )
+		size *= HAT_fanout;
+
+	amt = sizeof(Hat) + size + HAT_stripes * sizeof(HatLock);
+
+	if( amt & (HAT_cache_line - 1) )
+		amt |= HAT_cache_line - 1, amt++;
+
+	if( (seg = malloc(amt + HAT_seg)) ) {
+		seg->next = sizeof(*seg);
+		seg->seg = NULL;
+		if( round = (HatSlot)seg & (HAT_cache_line - 1) )
+			seg->next += HAT_cache_line - round;
+	} else {
+		hat_abort ("No virtual memory");
+	}
+
+	MaxMem += amt + HAT_seg;
+
+	hat = (Hat *)((uchar *)seg + HAT_seg);
+
+	memset(hat, 0, amt);
+	hat->bootlvl = boot;
+ 	hat->aux = aux;
+ 	hat->seg = seg;
+	hat->root = (HatSlot *)(hat + 1);
+	hat->locks = (HatLock *)((uchar *)hat->root + size);
+	hat->main = hat;
+#ifdef HAT_EBR
+	hat->epoch = 1;
+	hat->reader = hat_reader (hat);
+#endif
+
+	if( !boot )
+		*hat->root = (HatSlot)hat_alloc (hat, HAT_bucket) | HAT_bucket;
+
+	return hat;
+}
+
+//	hat images: hat_save writes the trie to a file with
+//	node offsets from the start of the image in place of
+//	pointers.  The root array and the nodes holding slots
+//	come first, then the array nodes, which hold no slots.
+//	hat_open_mapped maps the image copy-on-write, adds the
+//	mapping address to the slots of the inner nodes, and
+//	makes the mapping read only.  Array pages are never
+//	written, so they stay shared in the page cache.
+
+#define HAT_image_magic "HATimg01"
+#define HAT_bootmax 4
+
+typedef struct {
+	char magic[8];		// HAT_image_magic
+	uint fanout;		// HAT_fanout of the writer
+	uint slotsize;		// HAT_slot_size
+	uint tag;			// HAT_tag
+	uint merge;			// arrays kept sorted by HAT_MERGE
+	uint bootlvl;		// cascaded radix nodes in root
+	uint aux;			// auxilliary bytes per key
+	uint bucketslots;	// HatBucketSlots
+	uint bucketmax;		// HatBucketMax
+	uint pailmax;		// HatPailMax
+	uint hatmax;		// HatMax
+	uint sizes[HAT_classes];	// HatSize of every class
+	unsigned long long root;	// offset of the root array
+	unsigned long long leaf;	// offset of the first array node
+	unsigned long long size;	// image size
+} HatImage;
+
+//	progress of an image save, in image bytes
+
+typedef struct {
+	volatile unsigned long long size;	// image size, once counted
+	volatile unsigned long long done;	// image bytes written
+} HatProgress;
+
+typedef struct {
+	HatProgress *progress;	// optional progress report
+	FILE *out;			// image file
+	uchar *inner;		// root and inner nodes, image offset root
+	unsigned long long root;	// image offset of the inner buffer
+	unsigned long long next;	// next inner node offset
+	unsigned long long leaf;	// next array node offset
+	unsigned long long leaves;	// array node bytes
+} HatSave;
+
+#define hat_round8(amt) (((amt) + 7) & ~(unsigned long long)7)
+
+//	return the node's allocation class size
+
+uint hat_node_size (HatSlot node)
+{
+	switch( node & HAT_type ) {
+	case HAT_array:
+	  return HatSize[((HatBase *)(node & HAT_mask))->type];
+	case HAT_pail:
+	  return HatSize[HAT_pail];
+	case HAT_bucket:
+	  return HatSize[HAT_bucket];
+	}
+
+	return HatSize[hat_radix_class (node & HAT_type)];
+}
+
+//	return the inner bytes of the image below a node,
+//	adding up its array node bytes in save->leaves
+
+unsigned long long hat_save_size (HatSave *save, HatSlot node)
+{
+unsigned long long size;
+HatBucket *bucket;
+HatPail *pail;
+HatSlot child;
+uint idx;
+int ch;
+
+	switch( node & HAT_type ) {
+	case HAT_array:
+	  save->leaves += hat_node_size (node);
+	  return 0;
+
+	case HAT_pail:
+	  pail = (HatPail *)(node & HAT_mask);
+	  size = hat_round8 (HatSize[HAT_pail]);
+
+	  for( idx = 0; idx < HatPailMax; idx++ )
+		if( pail->array[idx] )
+		  save->leaves += hat_node_size (pail->array[idx]);
+
+	  return size;
+
+	case HAT_bucket:
+	  bucket = (HatBucket *)(node & HAT_mask);
+	  size = hat_round8 (HatSize[HAT_bucket]);
+
+	  for( idx = 0; idx < HatBucketSlots; idx++ )
+		if( bucket->slots[idx] )
+		  size += hat_save_size (save, bucket->slots[idx]);
+
+	  return size;
+	}
+
+	size = hat_round8 (hat_node_size (node));
+
+	for( ch = 0; (ch = hat_radix_scan (node, ch, 1, &child)) >= 0; ch++ )
+		size += hat_save_size (save, child);
+
+	return size;
+}
+
+//	write a node below the root to the image,
+//	returning its image slot
+
+HatSlot hat_save_node (HatSave *save, HatSlot node)
+{
+uint size = hat_node_size (node), idx;
+unsigned long long off;
+HatSlot copy, child;
+HatBucket *bucket;
+HatPail *pail;
+int ch;
+
+	if( !node )
+		return 0;
+
+	//	array nodes go out in turn after the inner nodes
+
+	if( (node & HAT_type) == HAT_array ) {
+	  off = save->leaf;
+	  save->leaf += size;
+
+	  if( fwrite ((void *)(node & HAT_mask), size, 1, save->out) != 1 )
+		return 0;
+
+	  if( save->progress )
+		save->progress->done += size;
+
+	  return off | HAT_array;
+	}
+
+	off = save->next;
+	save->next += hat_round8 (size);
+	copy = (HatSlot)(save->inner + off - save->root) | (node & HAT_type);
+	memcpy ((void *)(copy & HAT_mask), (void *)(node & HAT_mask), size);
+
+	switch( node & HAT_type ) {
+	case HAT_pail:
+	  pail = (HatPail *)(copy & HAT_mask);
+#ifdef HAT_ORDER
+	  pail->order = NULL;
+#endif
+	  for( idx = 0; idx < HatPailMax; idx++ )
+		pail->array[idx] = hat_save_node (save, pail->array[idx]);
+
+	  break;
+
+	case HAT_bucket:
+	  bucket = (HatBucket *)(copy & HAT_mask);
+#ifdef HAT_ORDER
+	  bucket->order = NULL;
+#endif
+	  for( idx = 0; idx < HatBucketSlots; idx++ )
+		bucket->slots[idx] = hat_save_node (save, bucket->slots[idx]);
+
+	  break;
+
+	default:
+	  for( ch = 0; (ch = hat_radix_scan (node, ch, 1, &child)) >= 0; ch++ )
+		*hat_radix_find (copy, ch) = hat_save_node (save, child);
+	}
+
+	return off | (node & HAT_type);
+}
+
+//	save the hat to an image file for hat_open_mapped,
+//	reporting the bytes written in progress if given.
+//	Returns TRUE/FALSE.  No writers may be active.
+
+int hat_save_image (Hat *hat, char *path, HatProgress *progress)
+{
+unsigned long long inner = 0, slot, slots = 1;
+HatSlot *root = hat->root;
+HatImage image[1];
+HatSave save[1];
+int ok = 1;
+
+	for( slot = 0; slot < hat->bootlvl; slot++ )
+		slots *= HAT_fanout;
+
+	memset (save, 0, sizeof(HatSave));
+	inner = hat_round8 (slots * HAT_slot_size);
+
+	for( slot = 0; slot < slots; slot++ )
+	  if( root[slot] )
+		inner += hat_save_size (save, root[slot]);
+
+	memset (image, 0, sizeof(HatImage));
+	memcpy (image->magic, HAT_image_magic, 8);
+	image->fanout = HAT_fanout;
+	image->slotsize = HAT_slot_size;
+	image->tag = HAT_tag;
+#ifdef HAT_MERGE
+	image->merge = 1;
+#endif
+	image->bootlvl = hat->bootlvl;
+	image->aux = hat->aux;
+	image->bucketslots = HatBucketSlots;
+	image->bucketmax = HatBucketMax;
+	image->pailmax = HatPailMax;
+	image->hatmax = HatMax;
+	memcpy (image->sizes, HatSize, sizeof(HatSize));
+	image->root = hat_round8 (sizeof(HatImage));
+	image->leaf = image->root + inner;
+	image->size = image->leaf + save->leaves;
+
+	if( save->progress = progress )
+		progress->done = 0, progress->size = image->size;
+
+	save->root = image->root;
+	save->next = image->root + hat_round8 (slots * HAT_slot_size);
+	save->leaf = image->leaf;
+
+	if( !(save->inner = calloc (inner, 1)) )
+		hat_abort ("Out of virtual memory");
+
+	if( !(save->out = fopen (path, "wb")) ) {
+		free (save->inner);
+		return 0;
+	}
+
+	if( fseek (save->out, image->leaf, SEEK_SET) )
+		ok = 0;
+
+	for( slot = 0; ok && slot < slots; slot++ )
+	  if( root[slot] )
+		if( !(((HatSlot *)save->inner)[slot] = hat_save_node (save, root[slot])) )
+		  ok = 0;
+
+	if( save->leaf != image->size )
+		ok = 0;
+
+	if( ok && fseek (save->out, 0, SEEK_SET) )
+		ok = 0;
+	if( ok && fwrite (image, sizeof(HatImage), 1, save->out) != 1 )
+		ok = 0;
+	if( ok && fseek (save->out, image->root, SEEK_SET) )
+		ok = 0;
+	if( ok && fwrite (save->inner, inner, 1, save->out) != 1 )
+		ok = 0;
+	if( fclose (save->out) )
+		ok = 0;
+
+	if( ok && progress )
+		progress->done = image->size;
+
+	free (save->inner);
+	return ok;
+}
+
+int hat_save (Hat *hat, char *path)
+{
+	return hat_save_image (hat, path, NULL);
+}
+
+//	check that a node lies in its part of the image and
+//	is in shape, then add the mapping address to its slot
+//	and the slots of the inner nodes below.  Returns FALSE
+//	for a node out of bounds or out of shape.  A slot seen
+//	twice holds an address by then, and fails the bounds.
+//	An array node's keys must hold exactly cnt keys, each
+//	ending by nxt.
+
+int hat_relocate (HatSlot *slot, HatImage *image)
+{
+unsigned long long off = *slot & HAT_mask;
+HatRadix48 *radix48;
+HatBucket *bucket;
+HatBase *base;
+HatPail *pail;
+HatSlot child;
+uint idx, tst, len;
+int ch;
+
+	if( !*slot )
+		return 1;
+
+	if( (*slot & HAT_type) == HAT_array ) {
+	  if( off < image->leaf || off + sizeof(HatBase) > image->size )
+		return 0;
+
+	  base = (HatBase *)((uchar *)image + off);
+
+	  if( base->type < HAT_1 || base->type > HatMax || off + HatSize[base->type] > image->size )
+		return 0;
+
+	  if( sizeof(HatBase) + base->nxt + base->cnt * image->aux > HatSize[base->type] )
+		return 0;
+
+	  for( idx = tst = 0; tst < base->nxt; idx++ ) {
+		if( (tst += HAT_tag + 1) > base->nxt )
+		  return 0;
+
+		if( (len = base->keys[tst - 1]) & 0x80 ) {
+		  if( tst == base->nxt )
+			return 0;
+		  len &= 0x7f, len += base->keys[tst++] << 7;
+		}
+
+		if( (tst += len) > base->nxt )
+		  return 0;
+	  }
+
+	  if( idx != base->cnt )
+		return 0;
+
+	  *slot += (HatSlot)image;
+	  return 1;
+	}
+
+	if( off < image->root || off >= image->leaf || off + hat_node_size (*slot) > image->leaf )
+		return 0;
+
+	*slot += (HatSlot)image;
+
+	switch( *slot & HAT_type ) {
+	case HAT_pail:
+	  pail = (HatPail *)(*slot & HAT_mask);
+
+	  for( idx = 0; idx < HatPailMax; idx++ ) {
+		if( (child = pail->array[idx]) && (child & HAT_type) != HAT_array )
+		  return 0;
+		if( !hat_relocate (&pail->array[idx], image) )
+		  return 0;
+	  }
+
+	  return 1;
+
+	case HAT_bucket:
+	  bucket = (HatBucket *)(*slot & HAT_mask);
+
+	  for( idx = 0; idx < HatBucketSlots; idx++ ) {
+		if( (child = bucket->slots[idx]) && (child & HAT_type) != HAT_array && (child & HAT_type) != HAT_pail )
+		  return 0;
+		if( !hat_relocate (&bucket->slots[idx], image) )
+		  return 0;
+	  }
+
+	  return 1;
+
+	case HAT_radix4:
+	  if( ((HatRadix4 *)(*slot & HAT_mask))->cnt > 4 )
+		return 0;
+
+	  break;
+
+	case HAT_radix16:
+	  if( ((HatRadix16 *)(*slot & HAT_mask))->cnt > 16 )
+		return 0;
+
+	  break;
+
+	case HAT_radix48:
+	  radix48 = (HatRadix48 *)(*slot & HAT_mask);
+
+	  for( ch = 0; ch < HAT_fanout; ch++ )
+		if( radix48->index[ch] > 48 )
+		  return 0;
+
+	  break;
+	}
+
+	for( ch = 0; (ch = hat_radix_scan (*slot, ch, 1, &child)) >= 0; ch++ )
+	  if( !hat_relocate (hat_radix_find (*slot, ch), image) )
+		return 0;
+
+	return 1;
+}
+
+//	map the image file copy-on-write, returning its
+//	address and size, or NULL
+
+void *hat_map (char *path, unsigned long long *size)
+{
+#ifdef _WIN32
+HANDLE file, map;
+LARGE_INTEGER len;
+void *image;
+
+	file = CreateFileA (path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if( file == INVALID_HANDLE_VALUE )
+		return NULL;
+
+	if( !GetFileSizeEx (file, &len) || !(map = CreateFileMappingA (file, NULL, PAGE_WRITECOPY, 0, 0, NULL)) ) {
+		CloseHandle (file);
+		return NULL;
+	}
+
+	image = MapViewOfFile (map, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle (map);
+	CloseHandle (file);
+
+	*size = len.QuadPart;
+	return image;
+#else
+struct stat st[1];
+void *image;
+int fd;
+
+	if( (fd = open (path, O_RDONLY)) < 0 )
+		return NULL;
+
+	if( fstat (fd, st) || !st->st_size ) {
+		close (fd);
+		return NULL;
+	}
+
+	image = mmap (NULL, st->st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close (fd);
+
+	*size = st->st_size;
+	return image == MAP_FAILED ? NULL : image;
+#endif
+}
+
+void hat_unmap (void *image, unsigned long long size)
+{
+#ifdef _WIN32
+	UnmapViewOfFile (image);
+#else
+	munmap (image, size);
+#endif
+}
+
+//	open a hat image written by hat_save for reading:
+//	hat_find, hat_find_batch and cursors work straight
+//	from the mapping, and hat_close unmaps it.  Returns
+//	NULL if the image is missing, or was written with
+//	other node sizes, fanout or aux bytes than these.
+
+void *hat_open_mapped (char *path)
+{
+unsigned long long size, slot, slots = 1;
+HatImage *image;
+HatSlot *root;
+#ifdef _WIN32
+DWORD old;
+#endif
+int ok = 1;
+Hat *hat;
+
+	if( !(image = hat_map (path, &size)) )
+		return NULL;
+
+	if( size < sizeof(HatImage) || memcmp (image->magic, HAT_image_magic, 8) || image->size != size
+	  || image->fanout != HAT_fanout || image->slotsize != HAT_slot_size || image->tag != HAT_tag
+	  || image->bucketslots != HatBucketSlots || image->bucketmax != HatBucketMax
+	  || image->pailmax != HatPailMax || image->hatmax != HatMax
+	  || memcmp (image->sizes, HatSize, sizeof(HatSize)) ) {
+		hat_unmap (image, size);
+		return NULL;
+	}
+
+#ifdef HAT_MERGE
+	if( !image->merge ) {
+#else
+	if( image->merge ) {
+#endif
+		hat_unmap (image, size);
+		return NULL;
+	}
+
+	//	the root array and the inner nodes must fit
+	//	between the header and the array nodes
+
+	if( image->bootlvl > HAT_bootmax || image->aux > HatSize[HatMax] || image->root != hat_round8 (sizeof(HatImage)) )
+		ok = 0;
+
+	for( slot = 0; slot < image->bootlvl; slot++ )
+		slots *= HAT_fanout;
+
+	if( ok && (image->leaf > size || image->leaf < image->root + slots * HAT_slot_size) )
+		ok = 0;
+
+	root = (HatSlot *)((uchar *)image + image->root);
+
+	for( slot = 0; ok && slot < slots; slot++ )
+	  if( !hat_relocate (root + slot, image) )
+		ok = 0;
+
+#ifdef _WIN32
+	if( ok && !VirtualProtect (image, size, PAGE_READONLY, &old) )
+		ok = 0;
+#else
+	if( ok && mprotect (image, size, PROT_READ) )
+		ok = 0;
+#endif
+
+	if( !ok ) {
+		hat_unmap (image, size);
+		return NULL;
+	}
+
+	if( !(hat = malloc (sizeof(Hat) + HAT_stripes * sizeof(HatLock))) )
+		hat_abort ("No virtual memory");
+
+	memset (hat, 0, sizeof(Hat) + HAT_stripes * sizeof(HatLock));
+	hat->bootlvl = image->bootlvl;
+	hat->aux = image->aux;
+	hat->root = root;
+	hat->locks = (HatLock *)(hat + 1);
+	hat->main = hat;
+	hat->image = image;
+	hat->imagesize = size;
+#ifdef HAT_EBR
+	hat->epoch = 1;
+	hat->reader = hat_reader (hat);
+#endif
+	return hat;
+}
+
+int hat_log_close (Hat *hat);
+
+//	close hat object, along with any thread
+//	handles opened on it, and its log
+
+void hat_close (Hat *hat)
+{
+HatSeg *seg, *nxt = hat->seg;
+#ifdef HAT_ORDER
+uint slot, slots = 1;
+#endif
+Hat *thread;
+
+#ifdef HAT_ORDER
+	//	cached orders live outside the segments, and
+	//	nodes of thread handles die with their segments
+
+	if( hat->main == hat && !hat->image ) {
+	  for( slot = 0; slot < hat->bootlvl; slot++ )
+		slots *= HAT_fanout;
+
+	  for( slot = 0; slot < slots; slot++ )
+		if( hat->root[slot] )
+		  hat_free_orders (hat->root[slot]);
+	}
+#endif
+
+	while( (thread = hat->threads) ) {
+		hat->threads = thread->threads;
+		thread->threads = NULL;
+		hat_close (thread);
+	}
+
+	if( hat->log )
+		hat_log_close (hat);
+
+	if( hat->image ) {
+		hat_unmap (hat->image, hat->imagesize);
+		free (hat);
+		return;
+	}
+
+#ifdef HAT_EBR
+	free (hat->retire);
+#endif
+
+	while( (seg = nxt) )
+		nxt = seg->seg, free (seg);
+}
+
+//	spin on a latch, yielding the processor
+//	when its holder may have been descheduled
+
+void hat_spin (uint *spin)
+{
+	if( ++*spin & 1023 )
+		hat_relax ();
+	else
+		hat_yield ();
+}
+
+//	make the latch version odd
+
+void hat_lock (volatile uint *latch)
+{
+uint spin = 0, version;
+
+	while( 1 ) {
+	  if( !((version = hat_version (latch)) & 1) )
+		if( hat_cas (latch, version, version + 1) )
+		  return;
+
+	  hat_spin (&spin);
+	}
+}
+
+//	make it even again, releasing the writes made under it
+
+void hat_unlock (volatile uint *latch)
+{
+	hat_bump (latch);
+}
+
+//	wait for and return a version no writer holds
+
+uint hat_stable (volatile uint *latch)
+{
+uint spin = 0, version;
+
+	while( (version = hat_version (latch)) & 1 )
+		hat_spin (&spin);
+
+	return version;
+}
+
+//	TRUE if no writer has held the latch since
+//	hat_stable returned version
+
+int hat_validate (volatile uint *latch, uint version)
+{
+	hat_fence ();
+	return hat_version (latch) == version;
+}
+
+//	open a handle on a hat for one more writer thread.
+//	It shares the root array, but allocates nodes from
+//	its own segments and reuse lists, so the _mt entry
+//	points only contend on the root slot latches.
+
+void *hat_thread (Hat *hat)
+{
+uint round;
+HatSeg *seg;
+Hat *thread;
+
+	hat = hat->main;
+
+	if( (seg = malloc(sizeof(Hat) + HAT_seg)) ) {
+		seg->next = sizeof(*seg);
+		seg->seg = NULL;
+		if( round = (HatSlot)seg & (HAT_cache_line - 1) )
+			seg->next += HAT_cache_line - round;
+	} else {
+		hat_abort ("No virtual memory");
+	}
+
+	hat_add (&MaxMem, sizeof(Hat) + HAT_seg);
+
+	thread = (Hat *)((uchar *)seg + HAT_seg);
+
+	memset(thread, 0, sizeof(Hat));
+	thread->bootlvl = hat->bootlvl;
+	thread->aux = hat->aux;
+	thread->seg = seg;
+	thread->root = hat->root;
+	thread->locks = hat->locks;
+	thread->main = hat;
+#ifdef HAT_EBR
+	thread->reader = hat_reader (hat);
+#endif
+
+	hat_lock (&hat->latch);
+	thread->threads = hat->threads;
+	hat->threads = thread;
+	hat_unlock (&hat->latch);
+	return thread;
+}
+
+//	fold two 64 bit values through
+//	a 64 x 64 -> 128 bit multiply
+
+HatCode hat_mum (HatCode a, HatCode b)
+{
+#if defined(__SIZEOF_INT128__)
+unsigned __int128 r = (unsigned __int128)a * b;
+
+	return (HatCode)r ^ (HatCode)(r >> 64);
+#else
+HatCode ha = a >> 32, la = (uint)a, hb = b >> 32, lb = (uint)b;
+HatCode hi = ha * hb, mid0 = ha * lb, mid1 = hb * la, lo = la * lb;
+HatCode t = lo + (mid0 << 32), carry = t < lo;
+
+	lo = t + (mid1 << 32);
+	carry += lo < t;
+	hi += (mid0 >> 32) + (mid1 >> 32) + carry;
+	return lo ^ hi;
+#endif
+}
+
+HatCode hat_read8 (uchar *buff)
+{
+HatCode val;
+
+	memcpy (&val, buff, 8);
+	return val;
+}
+
+HatCode hat_read4 (uchar *buff)
+{
+uint val;
+
+	memcpy (&val, buff, 4);
+	return val;
+}
+
+#define HAT_p0 0xa0761d6478bd642fULL
+#define HAT_p1 0xe7037ed1a0b428dbULL
+#define HAT_p2 0x8ebc6af09c88c6e3ULL
+
+//	compute 64 bit hash code for key after wyhash,
+//	folding in 16 bytes per multiply.
+
+//	a code of zero is taken to mean not yet computed,
+//	which merely costs a rehash when it really occurs.
+
+HatCode hat_code (uchar *buff, uint max)
+{
+HatCode seed = HAT_p0 ^ max, a, b;
+uint len = max, mid;
+
+	if( max <= 16 ) {
+	  if( max >= 4 ) {
+		mid = (max >> 3) << 2;
+		a = hat_read4 (buff) << 32 | hat_read4 (buff + mid);
+		b = hat_read4 (buff + max - 4) << 32 | hat_read4 (buff + max - 4 - mid);
+	  } else if( max ) {
+		a = (HatCode)buff[0] << 16 | (HatCode)buff[max >> 1] << 8 | buff[max - 1];
+		b = 0;
+	  } else
+		a = b = 0;
+	} else {
+	  while( max > 16 ) {
+		seed = hat_mum (hat_read8 (buff) ^ HAT_p1, hat_read8 (buff + 8) ^ seed);
+		buff += 16, max -= 16;
+	  }
+
+	  a = hat_read8 (buff + max - 16);
+	  b = hat_read8 (buff + max - 8);
+	}
+
+	return hat_mum (HAT_p2 ^ len, hat_mum (a ^ HAT_p1, b ^ seed));
+}
+
+//	store key with its tag and length prefix
+//	returning the number of bytes used
+
+uint hat_put_key (uchar *keys, uchar *buff, uint amt, HatCode code)
+{
+uint off = 0;
+
+	if( HAT_tag )
+	  if( code )
+		keys[off++] = hat_tag (code);
+	  else
+		keys[off++] = hat_tag (hat_code (buff, amt));
+
+	keys[off++] = amt & 0x7f;
+
+	if( amt > 0x7f )
+		keys[off - 1] |= 0x80, keys[off++] = amt >> 7;
+
+	memcpy (keys + off, buff, amt);
+	return off + amt;
+}
+
+#ifdef HAT_MERGE
+//	insert key into an array node in sorted order,
+//	moving up the keys after it and their data
+//	areas, and return the new key's cleared slot
+
+void *hat_put_sorted (Hat *hat, HatBase *base, uchar *buff, uint amt, HatCode code)
+{
+uchar *slots = (uchar *)base + HatSize[base->type];
+ushort tst = 0, off = 0, len;
+int idx, diff;
+
+	for( idx = 0; idx < base->cnt; idx++ ) {
+	  tst += HAT_tag;
+	  len = base->keys[tst++];
+	  if( len & 0x80 )
+		len &= 0x7f, len += base->keys[tst++] << 7;
+
+	  if( diff = memcmp (base->keys + tst, buff, len < amt ? len : amt) ) {
+		if( diff > 0 )
+		  break;
+	  } else if( len > amt )
+		  break;
+
+	  off = tst += len;
+	}
+
+	len = HAT_tag + (amt > 0x7f ? 2 : 1) + amt;
+	memmove (base->keys + off + len, base->keys + off, base->nxt - off);
+	hat_put_key (base->keys + off, buff, amt, code);
+	base->nxt += len;
+
+	if( hat->aux ) {
+	  memmove (slots - (base->cnt + 1) * hat->aux, slots - base->cnt * hat->aux, (base->cnt - idx) * hat->aux);
+	  memset (slots - (idx + 1) * hat->aux, 0, hat->aux);
+	}
+
+	base->cnt++;
+	return slots - (idx + 1) * hat->aux;
+}
+#endif
+
+void *hat_add_array (Hat *hat, HatSlot *parent, uchar *buff, uint amt, HatCode code, int pail);
+void *hat_new_array (Hat *hat, HatSlot *parent, uchar *buff, uint amt, HatCode code);
+
+//	add new key to existing HAT_pail node
+//	return auxilliary area pointer, or
+//	NULL if it doesn't fit PAIL array
+
+void *hat_add_pail (Hat *hat, HatSlot *parent, uchar *buff, uint amt, HatCode code)
+{
+HatPail *pail = (HatPail *)(*parent & HAT_mask);
+void *cell;
+uint slot;
+
+	if( !code )
+		code = hat_code (buff, amt);
+
+	slot = hat_pail_slot (code);
+	hat_unorder (&pail->order);
+
+	if( !pail->array[slot] )
+		return hat_new_array (hat, &pail->array[slot], buff, amt, code);
+
+	//	does room exist in slot?
+
+	if( cell = hat_add_array (hat, &pail->array[slot], buff, amt, code, 0) )
+		return cell;
+
+	return NULL;
+}
+
+//	create new HAT_pail node
+//	from full HAT array node
+//	by bursting it
+
+void *hat_new_pail (Hat *hat, HatSlot *parent, uchar *buff, uint amt, HatCode code)
+{
+HatBase *base = (HatBase *)(*parent & HAT_mask);
+ushort tst = 0, len, cnt = 0;
+HatCode keycode;
+HatPail *pail;
+uchar *cell;
+uint slot;
+
+	// strip array node keys into HAT_pail structure
+
+	pail = hat_alloc (hat, HAT_pail);
+
+	//	burst array node into new PAIL node
+
+	while( tst < base->nxt ) {
+	  tst += HAT_tag;
+	  len = base->keys[tst++];
+
+	  if( len & 0x80 )
+		len &= 0x7f, len += base->keys[tst++] << 7;
+
+	  keycode = hat_code (base->keys + tst, len);
+	  slot = hat_pail_slot (keycode);
+
+	  if( pail->array[slot] ) {
+		cell = hat_add_array (hat, &pail->array[slot], base->keys + tst, len, keycode, 0);
+		if( hat->aux )
+			memcpy(cell, (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux, hat->aux);
+	  } else {
+		cell = hat_new_array (hat, &pail->array[slot], base->keys + tst, len, keycode);
+		if(  hat->aux )
+			memcpy (cell, (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux, hat->aux);
+	  }
+
+	  tst += len;
+	  cnt++;
+	}
+
+	hat_publish (parent, (HatSlot)pail | HAT_pail);
+	hat_free (hat, base, base->type);
+	return hat_add_pail (hat, parent, buff, amt, code);
+}
+
+//	promote full array nodes to next larger size
+//	if configured, overflow to HAT_pail node
+
+void *hat_promote (Hat *hat, HatSlot *parent, uchar *buff, int amt, HatCode code, int pail)
+{
+HatBase *base = (HatBase *)(*parent & HAT_mask);
+uchar *oldslots, *newslots;
+ushort skip;
+uint type, oldtype;
+HatBase *newbase;
+#ifndef HAT_MERGE
+ushort tst;
+#endif
+
+	if( amt > 0x7f )
+		skip = 2 + HAT_tag;
+	else
+		skip = 1 + HAT_tag;
+
+	oldtype = type = base->type;
+	oldslots = (uchar *)base + HatSize[type];
+
+	//	calculate new array node big enough to contain keys
+	//	and associated slots
+
+	if( !hat->aux || base->cnt < 255 )
+	  do if( (base->cnt + 1) * hat->aux + base->nxt + amt + skip + sizeof(HatBase) > HatSize[type] )
+		continue;
+	   else
+		break;
+	  while( type++ < HatMax );
+	else
+	  type = HatMax + 1;
+
+	//  see if new key fits into largest array
+	//	if not, promote to HAT_pail as configured
+
+	if( type > HatMax )
+	  if( pail && HatPailMax )
+		return hat_new_pail (hat, parent, buff, amt, code);
+	  else
+		return NULL;
+
+	// promote node to next larger size
+
+	newbase = hat_alloc (hat, type);
+	newslots = (uchar *)newbase + HatSize[type];
+
+	//	copy old node contents
+
+	memcpy (newbase->keys, base->keys, base->nxt);	// copy keys in node
+
+	if( hat->aux )
+		memcpy (newslots - base->cnt * hat->aux, oldslots - base->cnt * hat->aux, base->cnt * hat->aux);	//	copy user slots
+
+#ifdef HAT_MERGE
+	//	insert new key in order
+
+	newbase->nxt = base->nxt;
+	newbase->cnt = base->cnt;
+	newbase->type = type;
+	newslots = hat_put_sorted (hat, newbase, buff, amt, code);
+
+	hat_publish (parent, (HatSlot)newbase | HAT_array);
+	hat_free (hat, base, oldtype);
+	return newslots;
+#else
+	//	append new node
+
+	tst = base->nxt;
+	newbase->nxt = tst + hat_put_key (newbase->keys + tst, buff, amt, code);
+	newbase->cnt = base->cnt + 1;
+	newbase->type = type;
+
+	hat_publish (parent, (HatSlot)newbase | HAT_array);
+	hat_free (hat, base, oldtype);
+	return newslots - newbase->cnt * hat->aux;
+#endif
+}
+
+//	make new hat array node
+//	to contain new key
+//	guaranteed to fit
+
+void *hat_new_array (Hat *hat, HatSlot *parent, uchar *buff, uint amt, HatCode code)
+{
+uint type = HAT_1;
+HatBase *base;
+ushort skip;
+
+	if( amt > 0x7f )
+		skip = 2 + HAT_tag;
+	else
+		skip = 1 + HAT_tag;
+
+	while( hat->aux + amt + skip + sizeof(HatBase) > HatSize[type] )
+		type++;
+
+	//	new key doesn't fit into largest array
+
+	if( type > HatMax )
+		return NULL;
+
+	base = hat_alloc (hat, type);
+	base->nxt = hat_put_key (base->keys, buff, amt, code);
+	base->type = type;
+	base->cnt = 1;
+
+	hat_publish (parent, (HatSlot)base | HAT_array);
+	return (uchar *)base + HatSize[type] - hat->aux;
+}
+
+//	add to existing hat array node
+
+//	return slot address
+//	  or NULL if it doesn't fit
+
+void *hat_add_array (Hat *hat, HatSlot *parent, uchar *buff, uint amt, HatCode code, int pail)
+{
+ushort skip, len;
+HatBase *base;
+uint type;
+
+	if( amt > 0x7f )
+		skip = 2 + HAT_tag;
+	else
+		skip = 1 + HAT_tag;
+
+	base = (HatBase *)(*parent & HAT_mask);
+	type = base->type;
+
+	// add key to existing array, in order under
+	// HAT_MERGE, where HAT_EBR readers need a copy
+
+	if( !hat->aux || base->cnt < 255 )
+	  if( (base->cnt + 1 ) * hat->aux + base->nxt + amt + skip + sizeof(HatBase) <= HatSize[type] ) {
+#ifdef HAT_MERGE
+		if( !HAT_ebr )
+		  return hat_put_sorted (hat, base, buff, amt, code);
+		else
+		  return hat_promote (hat, parent, buff, amt, code, pail);
+#endif
+		len = hat_put_key (base->keys + base->nxt, buff, amt, code);
+		hat_publish (&base->nxt, base->nxt + len);
+		base->cnt++;
+		return (uchar *)base + HatSize[type] - base->cnt * hat->aux;
+	  }
+
+	return hat_promote (hat, parent, buff, amt, code, pail);
+}
+
+//	burst full array node into new bucket node
+
+void hat_burst_array (Hat *hat, HatSlot *parent)
+{
+ushort tst, len, type, cnt;
+HatBucket *bucket;
+HatBase *base;
+HatCode code;
+uchar *cell;
+uint slot;
+
+	base = (HatBase *)(*parent & HAT_mask);
+	type = base->type;
+	cnt = tst = 0;
+
+	//	allocate new bucket node
+
+	bucket = hat_alloc (hat, HAT_bucket);
+
+	//	burst array node into new bucket node
+
+	while( tst < base->nxt ) {
+	  tst += HAT_tag;
+	  len = base->keys[tst++];
+	  if( len > 0x7f )
+		len &= 0x7f, len += base->keys[tst++] << 7;
+
+	  code = hat_code (base->keys + tst, len);
+	  slot = hat_bucket_slot (code);
+
+	  if( bucket->slots[slot] ) {
+		cell = hat_add_array (hat, &bucket->slots[slot], base->keys + tst, len, code, 1);
+		if( hat->aux )
+		  memcpy (cell, (uchar *)base + HatSize[type] - (cnt + 1) * hat->aux, hat->aux);
+	  } else {
+		cell = hat_new_array (hat, &bucket->slots[slot], base->keys + tst, len, code);
+		if( hat->aux )
+		  memcpy (cell, (uchar *)base + HatSize[type] - (cnt + 1) * hat->aux, hat->aux);
+	  }
+
+	  bucket->count++;
+	  tst += len;
+	  cnt++;
+	}
+
+	hat_publish (parent, (HatSlot)bucket | HAT_bucket);
+	hat_free (hat, base, type);
+}
+
+//	burst overflowing HAT_pail hash table into HAT_bucket hash table
+
+void hat_burst_pail (Hat *hat, HatSlot *parent)
+{
+HatPail *pail = (HatPail *)(*parent & HAT_mask);
+ushort tst, len, type, cnt, idx;
+HatBucket *bucket;
+HatBase *base;
+HatCode code;
+uchar *cell;
+uint slot;
+
+	//	allocate new bucket node
+
+	bucket = hat_alloc (hat, HAT_bucket);
+
+	//	burst pail array into new bucket node
+
+	for( idx = 0; idx < HatPailMax; idx++ ) {
+	 base = (HatBase *)(pail->array[idx] & HAT_mask);
+	 if( !base )
+		continue;
+
+	 cnt = tst = 0;
+
+	 while( tst < base->nxt ) {
+	  tst += HAT_tag;
+	  len = base->keys[tst++];
+
+	  if( len & 0x80 )
+		len &= 0x7f, len += base->keys[tst++] << 7;
+
+	  code = hat_code (base->keys + tst, len);
+	  slot = hat_bucket_slot (code);
+
+	  if( bucket->slots[slot] ) {
+		if( (bucket->slots[slot] & HAT_type) == HAT_array ) {
+		  cell = hat_add_array (hat, &bucket->slots[slot], base->keys + tst, len, code, 1);
+		  if( hat->aux )
+			memcpy (cell, (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux, hat->aux);
+		} else {
+		  cell = hat_add_pail (hat, &bucket->slots[slot], base->keys + tst, len, code);
+		  if( hat->aux )
+			memcpy (cell, (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux, hat->aux);
+		}
+	  } else {
+		  cell = hat_new_array (hat, &bucket->slots[slot], base->keys + tst, len, code);
+		  if( hat->aux )
+			memcpy (cell, (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux, hat->aux);
+	  }
+
+	   bucket->count++;
+	   tst += len;
+	   cnt++;
+	 }
+
+	 hat_free (hat, base, base->type);
+	}
+
+   hat_publish (parent, (HatSlot)bucket | HAT_bucket);
+   hat_free (hat, pail, HAT_pail);
+}
+
+//	add key to HAT_bucket node
+
+//	return 1 on success
+//	  or 0 if bucket overflows
+
+int hat_add_bucket (Hat *hat, HatSlot *parent, uchar *buff, uint amt, uchar *value)
+{
+HatBucket *bucket;
+HatCode code;
+uchar *cell;
+uint slot;
+
+	bucket = (HatBucket *)(*parent & HAT_mask);
+	code = hat_code (buff, amt);
+	slot = hat_bucket_slot (code);
+
+	if( bucket->count++ < HatBucketMax )
+	 if( !bucket->slots[slot] ) {
+	  cell = hat_new_array (hat, &bucket->slots[slot], buff, amt, code);
+	  if( hat->aux )
+		memcpy (cell, value, hat->aux);
+	  return 1;
+	 } else if( (bucket->slots[slot] & HAT_type) == HAT_array ) {
+	  if( cell = hat_add_array (hat, &bucket->slots[slot], buff, amt, code, 1) ) {
+	    memcpy (cell, value, hat->aux);
+		return 1;
+	  } else
+		return 0;
+	 } else
+	  if( cell = hat_add_pail (hat, &bucket->slots[slot], buff, amt, code) ) {
+	    memcpy (cell, value, hat->aux);
+	    return 1;
+	  } else
+		return 0;
+
+	return 0;
+}
+
+void hat_burst_bucket (Hat *hat, HatSlot *parent);
+
+//	burst HAT_bucket node node into HAT_radix entry
+//	moving key over one offset
+
+void hat_add_radix (Hat *hat, HatSlot *parent, uchar *buff, uint max, uchar *value)
+{
+HatSlot *slot;
+void *cell;
+uint ch;
+
+  //  shorten key by 1 byte
+
+  if( max )
+	ch = buff[0] + HAT_binary;
+  else
+	ch = 0;
+
+  slot = hat_radix_slot (hat, parent, ch);
+  *hat_radix_count (*parent) += 1;
+
+  //  if radix slot is empty, create new HAT_array node
+
+  if( !*slot ) {
+	cell = hat_new_array (hat, slot, buff + 1, max ? max - 1 : 0, 0);
+	if( hat->aux )
+		memcpy (cell, value, hat->aux);
+	return;
+  }
+
+  //  otherwise, add to existing node
+
+  do switch( *slot & HAT_type ) {
+	case HAT_bucket:
+	  if( hat_add_bucket (hat, slot, buff + 1, max - 1, value) )
+		return;
+
+	  hat_burst_bucket (hat, slot);
+	  continue;
+
+	case HAT_radix:
+	case HAT_radix4:
+	case HAT_radix16:
+	case HAT_radix48:
+	  hat_add_radix (hat, slot, buff + 1, max - 1, value);
+	  return;
+
+	case HAT_array:
+	  if( cell = hat_add_array (hat, slot, buff + 1, max - 1, 0, 1) ) {
+		if( hat->aux )
+			memcpy (cell, value, hat->aux);
+		return;
+	  }
+
+	  //  the array may have overflowed into a pail
+
+	  if( (*slot & HAT_type) == HAT_array )
+		hat_burst_array (hat, slot);
+	  continue;
+
+	case HAT_pail:
+	  if( cell = hat_add_pail (hat, slot, buff + 1, max - 1, 0) ) {
+		if( hat->aux )
+			memcpy (cell, value, hat->aux);
+		return;
+	  }
+
+	  hat_burst_pail (hat, slot);
+	  continue;
+  } while( 1 );
+}
+
+//	decompose full bucket to radix node
+
+void hat_burst_bucket (Hat *hat, HatSlot *parent)
+{
+HatBucket *bucket;
+HatBase *base;
+HatPail *pail;
+uint hash, idx;
+ushort tst, cnt;
+HatSlot node;
+ushort len;
+
+  bucket = (HatBucket *)(*parent & HAT_mask);
+
+  if( bucket->count < HatBucketMax )
+	Small++;
+
+  //	allocate new radix node, which grows as the
+  //	bucket's keys are added to it before it is
+  //	published in the parent slot
+
+  node = (HatSlot)hat_alloc (hat, HAT_node4) | HAT_radix4;
+
+  for( hash = 0; hash < HatBucketSlots; hash++ )
+   if( bucket->slots[hash] )
+    switch( bucket->slots[hash] & HAT_type ) {
+    case HAT_array:
+	  base = (HatBase *)(bucket->slots[hash] & HAT_mask);
+	  cnt = tst = 0;
+
+	  while( tst < base->nxt ) {
+		tst += HAT_tag;
+		len = base->keys[tst++];
+		if( len > 0x7f )
+			len &= 0x7f, len += base->keys[tst++] << 7;
+		hat_add_radix (hat, &node, base->keys + tst, len, (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux);
+		tst += len;
+		cnt++;
+	  }
+
+	  hat_free (hat, base, base->type);
+	  continue;
+
+	case HAT_pail:
+	  pail = (HatPail *)(bucket->slots[hash] & HAT_mask);
+
+	  for( idx = 0; idx < HatPailMax; idx++ ) {
+	    base = (HatBase *)(pail->array[idx] & HAT_mask);
+
+		if( !base )
+		  continue;
+
+  		cnt = tst = 0;
+
+		while( tst < base->nxt ) {
+		  tst += HAT_tag;
+		  len = base->keys[tst++];
+
+		  if( len > 0x7f )
+			len &= 0x7f, len += base->keys[tst++] << 7;
+
+		  hat_add_radix (hat, &node, base->keys + tst, len, (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux);
+		  tst += len;
+		  cnt++;
+		}
+
+		hat_free (hat, base, base->type);
+	  }
+	  hat_free (hat, pail, HAT_pail);
+	}
+
+  hat_publish (parent, node);
+  hat_free (hat, bucket, HAT_bucket);
+}
+
+//	compare two keys of equal length
+//	returning zero if they match
+
+//	long keys are compared 32 or 16 bytes
+//	per instruction, starting with the
+//	last block where URLs tend to differ
+
+int keycmp (uchar *str1, uchar *str2, uint len)
+{
+#ifdef HAT_sse2
+	if( len >= 16 ) {
+	  if( _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((__m128i *)(str1 + len - 16)), _mm_loadu_si128 ((__m128i *)(str2 + len - 16)))) != 0xffff )
+		return 1;
+
+	  len -= 16;
+#ifdef HAT_avx2
+	  while( len >= 32 )
+		if( _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (_mm256_loadu_si256 ((__m256i *)str1), _mm256_loadu_si256 ((__m256i *)str2))) != -1 )
+		  return 1;
+		else
+		  str1 += 32, str2 += 32, len -= 32;
+#endif
+	  while( len >= 16 )
+		if( _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((__m128i *)str1), _mm_loadu_si128 ((__m128i *)str2))) != 0xffff )
+		  return 1;
+		else
+		  str1 += 16, str2 += 16, len -= 16;
+	}
+#endif
+	while( len & (HAT_slot_size - 1) )
+	  if( len--, str1[len] != str2[len] )
+		return 1;
+
+	while( len )
+	  if( *(HatSlot *)str1 != *(HatSlot *)str2 )
+		return 1;
+	  else {
+		str1 += HAT_slot_size;
+		str2 += HAT_slot_size;
+		len -= HAT_slot_size;
+	  }
+
+	return 0;
+}
+
+//	scan HAT_array node for key with given hash code
+//	returning its index in the node, or -1
+
+int hat_scan_array (HatBase *base, uchar *buff, uint amt, HatCode code)
+{
+uchar tag = hat_tag (code), ch = tag;
+ushort tst = 0, nxt = hat_load (&base->nxt);
+uint len;
+int cnt = 0;
+
+	while( tst < nxt ) {
+		Probes++;
+
+		if( HAT_tag )
+			ch = base->keys[tst++];	// key tag
+
+		len = base->keys[tst++];	// key length
+
+		if( len > 0x7f )
+			len &= 0x7f, len += base->keys[tst++] << 7;
+
+		if( len == amt && ch == tag )
+		  if( !keycmp (base->keys + tst, buff, len) )
+			return cnt;
+
+		tst += len;
+		cnt++;
+	}
+
+	return -1;
+}
+
+//	hat_find: find string in hat array
+//	returning a pointer to associated slot
+
+void *hat_find (Hat *hat, uchar *buff, uint max)
+{
+HatSlot next, *table;
+HatBucket *bucket;
+HatBase *base;
+HatPail *pail;
+HatCode code = 0;
+uint triple = 0;
+uint off = 0;
+uint tst;
+int idx;
+uint ch;
+
+  for( tst = 0; tst < hat->bootlvl; tst++ ) {
+	triple *= HAT_fanout;
+	if( off < max )
+	  triple += buff[off++] + HAT_binary;
+  }
+
+  next = hat_load (&hat->root[triple]);
+
+  while( next )
+	switch( next & HAT_type ) {
+	case HAT_array:
+	  base = (HatBase *)(next & HAT_mask);
+	  Searches++;
+
+	  //  find slot == key
+
+	  if( HAT_tag && !code )
+		code = hat_code (buff + off, max - off);
+
+	  if( (idx = hat_scan_array (base, buff + off, max - off, code)) < 0 )
+		return NULL;
+
+	  if( hat->aux )
+		return (uchar *)base + HatSize[base->type] - (idx + 1) * hat->aux;
+
+	  return (void *)1;
+
+	case HAT_pail:
+	  pail = (HatPail *)(next & HAT_mask);
+	  Pail++;
+
+	  if( !code )
+		code = hat_code (buff + off, max - off);
+
+	  if( next = hat_load (&pail->array[hat_pail_slot (code)]) )
+		continue;
+
+	  return NULL;
+
+	case HAT_bucket:
+	  bucket = (HatBucket *)(next & HAT_mask);
+	  Bucket++;
+
+	  if( !code )
+		code = hat_code (buff + off, max - off);
+
+	  if( next = hat_load (&bucket->slots[hat_bucket_slot (code)]) )
+		continue;
+
+	  return NULL;
+
+	case HAT_radix:
+	  table = (HatSlot *)(next & HAT_mask);
+	  Radix++;
+
+	  if( off < max )
+		ch = buff[off++] + HAT_binary;
+	  else
+		ch = 0;
+
+	  next = hat_load (&table[ch]);
+	  continue;
+
+	case HAT_radix4:
+	case HAT_radix16:
+	case HAT_radix48:
+	  Radix++;
+
+	  if( off < max )
+		ch = buff[off++] + HAT_binary;
+	  else
+		ch = 0;
+
+	  if( table = hat_radix_find (next, ch) )
+		next = hat_load (table);
+	  else
+		return NULL;
+
+	  continue;
+	}
+
+	return NULL;
+}
+
+//	hat_find_batch: lookup state for
+//	one key in flight
+
+#define HAT_batch 16	// number of keys in flight
+
+typedef struct {
+	HatSlot *next;		// prefetched slot to load next
+	HatSlot node;		// prefetched array or radix node to search
+	uchar *buff;		// key being searched
+	uint max;			// key length
+	uint off;			// key bytes consumed by radix nodes
+	HatCode code;		// hash code of the rest of the key
+	uint idx;			// key index in the batch
+} HatProbe;
+
+//	begin search for key, prefetching its root slot
+
+void hat_probe_start (Hat *hat, HatProbe *probe, uchar *buff, uint max, uint idx)
+{
+uint triple = 0, tst;
+
+	probe->buff = buff;
+	probe->max = max;
+	probe->off = 0;
+	probe->code = 0;
+	probe->idx = idx;
+	probe->node = 0;
+
+	for( tst = 0; tst < hat->bootlvl; tst++ ) {
+	  triple *= HAT_fanout;
+	  if( probe->off < max )
+		triple += buff[probe->off++] + HAT_binary;
+	}
+
+	probe->next = &hat->root[triple];
+	hat_prefetch (probe->next);
+}
+
+//	advance key search by one node, whose cache
+//	line was prefetched by the previous step,
+//	and prefetch the node after it.
+
+//	return zero when the search is finished
+//	and the result has been stored in out
+
+int hat_probe_step (Hat *hat, HatProbe *probe, void **out)
+{
+uint off = probe->off, max = probe->max;
+uchar *buff = probe->buff;
+HatBucket *bucket;
+HatSlot *table;
+HatBase *base;
+HatPail *pail;
+HatSlot next;
+int idx;
+
+	if( next = probe->node ) {
+	  probe->node = 0;
+
+	  //  scan array node for rest of key
+
+	  base = (HatBase *)(next & HAT_mask);
+
+	  if( HAT_tag && !probe->code )
+		probe->code = hat_code (buff + off, max - off);
+
+	  if( (idx = hat_scan_array (base, buff + off, max - off, probe->code)) < 0 )
+		out[probe->idx] = NULL;
+	  else if( hat->aux )
+		out[probe->idx] = (uchar *)base + HatSize[base->type] - (idx + 1) * hat->aux;
+	  else
+		out[probe->idx] = (void *)1;
+
+	  return 0;
+	}
+
+load:
+	if( !(next = hat_load (probe->next)) ) {
+	  out[probe->idx] = NULL;
+	  return 0;
+	}
+
+	switch( next & HAT_type ) {
+	case HAT_array:
+	  base = (HatBase *)(next & HAT_mask);
+	  probe->node = next;
+	  Searches++;
+
+	  hat_prefetch (base);
+	  hat_prefetch ((uchar *)base + 64);
+	  return 1;
+
+	//  small radix nodes are few and stay cached,
+	//	so their child slot is loaded directly
+
+	case HAT_radix4:
+	case HAT_radix16:
+	case HAT_radix48:
+	  Radix++;
+
+	  if( !(probe->next = hat_radix_find (next, off < max ? buff[off] + HAT_binary : 0)) ) {
+		out[probe->idx] = NULL;
+		return 0;
+	  }
+
+	  if( off < max )
+		probe->off = ++off;
+
+	  goto load;
+
+	case HAT_pail:
+	  pail = (HatPail *)(next & HAT_mask);
+	  Pail++;
+
+	  if( !probe->code )
+		probe->code = hat_code (buff + off, max - off);
+
+	  probe->next = &pail->array[hat_pail_slot (probe->code)];
+	  break;
+
+	case HAT_bucket:
+	  bucket = (HatBucket *)(next & HAT_mask);
+	  Bucket++;
+
+	  if( !probe->code )
+		probe->code = hat_code (buff + off, max - off);
+
+	  probe->next = &bucket->slots[hat_bucket_slot (probe->code)];
+	  break;
+
+	case HAT_radix:
+	  table = (HatSlot *)(next & HAT_mask);
+	  Radix++;
+
+	  if( off < max )
+		probe->next = &table[buff[probe->off++] + HAT_binary];
+	  else
+		probe->next = &table[0];
+
+	  break;
+	}
+
+	hat_prefetch (probe->next);
+	return 1;
+}
+
+//	hat_find_batch: find cnt strings in hat array
+//	storing the hat_find result for each in out[]
+
+//	HAT_batch searches are kept in flight and advanced
+//	round robin, so each node's cache miss overlaps
+//	the work on the other keys.
+
+void hat_find_batch (Hat *hat, uchar **keys, uint *lens, void **out, uint cnt)
+{
+HatProbe probe[HAT_batch];
+uint idx = 0, slot, live;
+
+	for( live = 0; live < HAT_batch && idx < cnt; live++, idx++ )
+	  hat_probe_start (hat, probe + live, keys[idx], lens[idx], idx);
+
+	while( live )
+	  for( slot = 0; slot < live; slot++ )
+		if( !hat_probe_step (hat, probe + slot, out) )
+		  if( idx < cnt )
+			hat_probe_start (hat, probe + slot, keys[idx], lens[idx], idx), idx++;
+		  else
+			probe[slot--] = probe[--live];
+}
+
+//	undo the radix key counts taken by hat_cell
+//	on its way down to a key that already existed
+
+void hat_uncount (Hat *hat, uchar *buff, uint max, uint levels)
+{
+uint triple = 0;
+uint off = 0;
+HatSlot node;
+uint tst;
+
+  for( tst = 0; tst < hat->bootlvl; tst++ ) {
+	triple *= HAT_fanout;
+	if( off < max )
+	  triple += buff[off++] + HAT_binary;
+  }
+
+  node = hat->root[triple];
+
+  while( levels-- ) {
+	*hat_radix_count (node) -= 1;
+
+	if( off < max )
+	  node = *hat_radix_find (node, buff[off++] + HAT_binary);
+	else
+	  node = *hat_radix_find (node, 0);
+  }
+}
+
+//	hat_cell: add string to hat array
+//	returning address of associated slot
+
+void *hat_cell (Hat *hat, uchar *buff, uint max)
+{
+HatSlot *table, *next, *parent, node;
+HatBucket *bucket;
+HatBase *base;
+HatPail *pail;
+HatCode code = 0;
+uint triple = 0;
+uint radix = 0;
+uint off = 0;
+void *cell;
+uint tst;
+int idx;
+uint ch;
+
+  if( hat->main->image )
+	hat_abort ("hat_cell on a mapped hat");
+
+#ifdef HAT_EBR
+  if( hat->retired >= HAT_reclaim )
+	hat_reclaim (hat);
+#endif
+
+  for( tst = 0; tst < hat->bootlvl; tst++ ) {
+	triple *= HAT_fanout;
+	if( off < max )
+	  triple += buff[off++] + HAT_binary;
+  }
+
+  next = &hat->root[triple];
+  parent = NULL;
+
+loop:
+  while( node = *next )
+	switch( node & HAT_type ) {
+	case HAT_array:
+	  base = (HatBase *)(node & HAT_mask);
+
+	  //  find slot == key
+
+	  if( HAT_tag && !code )
+		code = hat_code (buff + off, max - off);
+
+	  if( (idx = hat_scan_array (base, buff + off, max - off, code)) >= 0 ) {
+		if( radix )
+		  hat_uncount (hat, buff, max, radix);
+		if( hat->aux )
+		  return (uchar *)base + HatSize[base->type] - (idx + 1) * hat->aux;
+		else
+		  return (void *)1;
+	  }
+
+	  //  if parent node is a full bucket node,
+	  //  burst it and loop to reprocess insert
+
+	  if( parent ) {
+		hat_unorder (&bucket->order);
+
+		if( bucket->count++ < HatBucketMax )
+		  if( cell = hat_add_array (hat, next, buff + off, max - off, code, 1) )
+			if( hat->aux )
+			  return cell;
+			else
+			  return (void *)0;
+
+		hat_burst_bucket (hat, parent);
+		next = parent;
+		parent = NULL;
+		continue;
+	  }
+
+	  // add new key to existing array or create new pail array node
+
+	  if( cell = hat_add_array (hat, next, buff + off, max - off, code, 1) )
+		if( hat->aux )
+		  return cell;
+		else
+		  return (void *)0;
+
+	  //  burst full array node into HAT_bucket node
+	  //  and loop to reprocess the insert, unless
+	  //  it has already overflowed into a pail
+
+	  if( (*next & HAT_type) == HAT_array )
+		hat_burst_array (hat, next);
+	  continue;
+
+	case HAT_pail:
+	  pail = (HatPail *)(node & HAT_mask);
+
+	  //  find slot == key
+
+	  if( !code )
+		code = hat_code (buff + off, max - off);
+
+	  if( base = (HatBase *)(pail->array[hat_pail_slot (code)] & HAT_mask) )
+		if( (idx = hat_scan_array (base, buff + off, max - off, code)) >= 0 ) {
+		  if( radix )
+			hat_uncount (hat, buff, max, radix);
+		  if( hat->aux )
+			return (uchar *)base + HatSize[base->type] - (idx + 1) * hat->aux;
+		  else
+			return (void *)1;
+		}
+
+	  //  if parent node is a full bucket node,
+	  //  burst it and loop to reprocess insert
+
+	 if( parent ) {
+		hat_unorder (&bucket->order);
+
+		if( bucket->count++ < HatBucketMax )
+		  if( cell = hat_add_pail (hat, next, buff + off, max - off, code) )
+			if( hat->aux )
+			  return cell;
+			else
+			  return (void *)0;
+
+		hat_burst_bucket (hat, parent);
+		next = parent;
+		parent = NULL;
+		continue;
+	  }
+
+	  if( cell = hat_add_pail (hat, next, buff + off, max - off, code) )
+		if( hat->aux )
+		  return cell;
+		else
+		  return (void *)0;
+
+	  //  burst full pail node into HAT_bucket node
+	  //  and loop to reprocess the insert
+
+	  hat_burst_pail (hat, next);
+	  continue;
+
+	case HAT_bucket:
+	  bucket = (HatBucket *)(node & HAT_mask);
+
+	  if( !code )
+		code = hat_code (buff + off, max - off);
+
+	  parent = next;
+	  next = &bucket->slots[hat_bucket_slot (code)];
+	  continue;
+
+	case HAT_radix:
+	case HAT_radix4:
+	case HAT_radix16:
+	case HAT_radix48:
+	  if( off < max )
+	  	ch = buff[off++] + HAT_binary;
+	  else
+	  	ch = 0;
+
+	  //  count the key in the radix node, to
+	  //  be taken back if it is already present
+
+	  table = next;
+	  next = hat_radix_slot (hat, table, ch);
+	  *hat_radix_count (*table) += 1;
+	  radix++;
+	  code = 0;
+	  continue;
+	}
+
+	// place new array node under HAT_bucket
+	//	loop if bucket overflows
+
+	if( parent ) {
+	  hat_unorder (&bucket->order);
+
+	  if( bucket->count++ < HatBucketMax ) {
+	   if( cell = hat_new_array (hat, next, buff + off, max - off, code) )
+		if( hat->aux )
+		  return cell;
+		else
+		  return (void *)0;
+
+	   hat_burst_bucket (hat, parent);
+	   next = parent;
+	   parent = NULL;
+	   goto loop;
+	  }
+	}
+
+	// place new array node under HAT_radix
+
+	cell = hat_new_array (hat, next, buff + off, max - off, code);
+
+	if( hat->aux )
+		return cell;
+
+	return (void *)0;
+}
+
+//	remove the idx'th key and its aux bytes from the
+//	array node in slot, moving it into a smaller size
+//	class when it would fill no more than 3/4 of one,
+//	or freeing it when it is empty.  Under HAT_EBR the
+//	node is always replaced by a copy, as readers may
+//	be scanning it.
+
+void hat_del_array (Hat *hat, HatSlot *slot, int idx)
+{
+HatBase *base = (HatBase *)(*slot & HAT_mask);
+ushort tst = 0, start = 0, len;
+uchar *slots, *newslots;
+HatBase *newbase;
+uint type, used;
+int cnt;
+
+	if( base->cnt == 1 ) {
+	  hat_publish (slot, 0);
+	  hat_free (hat, base, base->type);
+	  return;
+	}
+
+	for( cnt = 0; cnt <= idx; cnt++ ) {
+	  start = tst;
+	  tst += HAT_tag;
+	  len = base->keys[tst++];
+	  if( len & 0x80 )
+		len &= 0x7f, len += base->keys[tst++] << 7;
+	  tst += len;
+	}
+
+	slots = (uchar *)base + HatSize[base->type];
+	used = (base->cnt - 1) * hat->aux + base->nxt - (tst - start) + sizeof(HatBase);
+
+	for( type = HAT_1; type < base->type; type++ )
+	  if( used <= HatSize[type] * 3 / 4 )
+		break;
+
+	//	close up the key bytes and the aux slots
+	//	of the keys that followed it
+
+	if( !HAT_ebr && type == base->type ) {
+	  memmove (base->keys + start, base->keys + tst, base->nxt - tst);
+	  base->nxt -= tst - start;
+
+	  //  and clear the freed last slot, as the
+	  //  next key added to the node takes it
+
+	  if( hat->aux ) {
+		memmove (slots - (base->cnt - 1) * hat->aux, slots - base->cnt * hat->aux, (base->cnt - idx - 1) * hat->aux);
+		memset (slots - base->cnt * hat->aux, 0, hat->aux);
+	  }
+
+	  base->cnt--;
+	  return;
+	}
+
+	//	or copy the other keys and aux slots
+	//	into a new node
+
+	newbase = hat_alloc (hat, type);
+	newslots = (uchar *)newbase + HatSize[type];
+
+	memcpy (newbase->keys, base->keys, start);
+	memcpy (newbase->keys + start, base->keys + tst, base->nxt - tst);
+
+	if( hat->aux ) {
+	  memcpy (newslots - idx * hat->aux, slots - idx * hat->aux, idx * hat->aux);
+	  memcpy (newslots - (base->cnt - 1) * hat->aux, slots - base->cnt * hat->aux, (base->cnt - idx - 1) * hat->aux);
+	}
+
+	newbase->nxt = base->nxt - (tst - start);
+	newbase->cnt = base->cnt - 1;
+	newbase->type = type;
+
+	hat_publish (slot, (HatSlot)newbase | HAT_array);
+	hat_free (hat, base, base->type);
+}
+
+//	add one key with its aux bytes to the array
+//	or bucket node being built in dest,
+//	returning zero if it doesn't fit
+
+int hat_put_node (Hat *hat, HatSlot *dest, uchar *buff, uint amt, uchar *value)
+{
+void *cell;
+
+	if( amt > 0x7fff || hat->aux + amt + 2 + HAT_tag + sizeof(HatBase) > HatSize[HatMax] )
+	  return 0;
+
+	if( (*dest & HAT_type) == HAT_bucket )
+	  return hat_add_bucket (hat, dest, buff, amt, value);
+
+	if( *dest )
+	  cell = hat_add_array (hat, dest, buff, amt, 0, 0);
+	else
+	  cell = hat_new_array (hat, dest, buff, amt, 0);
+
+	if( !cell )
+	  return 0;
+
+	if( hat->aux )
+	  memcpy (cell, value, hat->aux);
+
+	return 1;
+}
+
+//	copy every key below node into the array or
+//	bucket node in dest, the first off bytes of
+//	each key being already in buff.  No key longer
+//	than the largest array node will fit, so buff
+//	need only be that big.
+
+int hat_copy_keys (Hat *hat, HatSlot node, uchar *buff, uint off, HatSlot *dest)
+{
+HatBucket *bucket;
+HatBase *base;
+HatPail *pail;
+ushort tst, len;
+HatSlot child;
+uint idx, cnt;
+int ch;
+
+  switch( node & HAT_type ) {
+  case HAT_array:
+	base = (HatBase *)(node & HAT_mask);
+	cnt = tst = 0;
+
+	while( tst < base->nxt ) {
+	  tst += HAT_tag;
+	  len = base->keys[tst++];
+	  if( len & 0x80 )
+		len &= 0x7f, len += base->keys[tst++] << 7;
+
+	  if( off + len > HatSize[HatMax] )
+		return 0;
+
+	  memcpy (buff + off, base->keys + tst, len);
+
+	  if( !hat_put_node (hat, dest, buff, off + len, (uchar *)base + HatSize[base->type] - ++cnt * hat->aux) )
+		return 0;
+
+	  tst += len;
+	}
+
+	return 1;
+
+  case HAT_pail:
+	pail = (HatPail *)(node & HAT_mask);
+
+	for( idx = 0; idx < HatPailMax; idx++ )
+	  if( pail->array[idx] )
+		if( !hat_copy_keys (hat, pail->array[idx], buff, off, dest) )
+		  return 0;
+
+	return 1;
+
+  case HAT_bucket:
+	bucket = (HatBucket *)(node & HAT_mask);
+
+	for( idx = 0; idx < HatBucketSlots; idx++ )
+	  if( bucket->slots[idx] )
+		if( !hat_copy_keys (hat, bucket->slots[idx], buff, off, dest) )
+		  return 0;
+
+	return 1;
+  }
+
+  //  radix nodes supply the next key byte,
+  //  except for the end-of-key slot zero
+
+  if( off >= HatSize[HatMax] )
+	return 0;
+
+  for( ch = 0; (ch = hat_radix_scan (node, ch, 1, &child)) >= 0; ch++ )
+	if( ch ) {
+	  buff[off] = ch - HAT_binary;
+	  if( !hat_copy_keys (hat, child, buff, off + 1, dest) )
+		return 0;
+	} else if( !hat_copy_keys (hat, child, buff, off, dest) )
+	  return 0;
+
+  return 1;
+}
+
+//	collapse the radix node in slot back into one
+//	array node, or a bucket node if they don't fit.
+//	The node is left alone if neither will hold its keys.
+//	The key buffer is a largest array block off the reuse
+//	list, put straight back as it is never published.
+
+void hat_collapse (Hat *hat, HatSlot *slot)
+{
+uint count = *hat_radix_count (*slot);
+uchar *buff = hat_alloc (hat, HatMax);
+HatSlot node = 0;
+
+	if( !hat->aux || count < 255 )
+	  if( count * (hat->aux + 2 + HAT_tag) + sizeof(HatBase) <= HatSize[HatMax] )
+		if( !hat_copy_keys (hat, *slot, buff, 0, &node) )
+		  hat_free_node (hat, node), node = 0;
+
+	if( !node ) {
+	  node = (HatSlot)hat_alloc (hat, HAT_bucket) | HAT_bucket;
+
+	  if( !hat_copy_keys (hat, *slot, buff, 0, &node) )
+		hat_free_node (hat, node), node = 0;
+	}
+
+	hat->counts[HatMax]--;
+	hat_release (hat, buff, HatMax);
+
+	if( !node )
+	  return;
+
+	hat_free_node (hat, *slot);
+	hat_publish (slot, node);
+}
+
+//	delete key from the node in slot, freeing nodes
+//	that become empty and collapsing small radix nodes
+//	when fold is set.  Returns 1 if the key was found.
+
+int hat_del_node (Hat *hat, HatSlot *slot, uchar *buff, uint off, uint max, HatCode code, int fold)
+{
+HatSlot *next, node = *slot;
+HatBucket *bucket;
+HatBase *base;
+HatPail *pail;
+uint *count;
+uint ch;
+int idx;
+
+  switch( node & HAT_type ) {
+  case HAT_array:
+	base = (HatBase *)(node & HAT_mask);
+
+	if( HAT_tag && !code )
+	  code = hat_code (buff + off, max - off);
+
+	if( (idx = hat_scan_array (base, buff + off, max - off, code)) < 0 )
+	  return 0;
+
+	hat_del_array (hat, slot, idx);
+	return 1;
+
+  case HAT_pail:
+	pail = (HatPail *)(node & HAT_mask);
+
+	if( !code )
+	  code = hat_code (buff + off, max - off);
+
+	next = &pail->array[hat_pail_slot (code)];
+
+	if( !*next || !hat_del_node (hat, next, buff, off, max, code, 0) )
+	  return 0;
+
+	hat_unorder (&pail->order);
+
+	if( *next )
+	  return 1;
+
+	for( idx = 0; idx < HatPailMax; idx++ )
+	  if( pail->array[idx] )
+		return 1;
+
+	hat_publish (slot, 0);
+	hat_free (hat, pail, HAT_pail);
+	return 1;
+
+  case HAT_bucket:
+	bucket = (HatBucket *)(node & HAT_mask);
+
+	if( !code )
+	  code = hat_code (buff + off, max - off);
 
-	for( idx = 0; idx < boot; idx++ )
-		size *= 128;
+	next = &bucket->slots[hat_bucket_slot (code)];
 
-	amt = sizeof(Hat) + size;
+	if( !*next || !hat_del_node (hat, next, buff, off, max, code, 0) )
+	  return 0;
 
-	if( amt & (HAT_cache_line - 1) )
-		amt |= HAT_cache_line - 1, amt++;
+	hat_unorder (&bucket->order);
 
-	if( (seg = malloc(amt + HAT_seg)) ) {
-		seg->next = sizeof(*seg);
-		seg->seg = NULL;
-		if( round = (HatSlot)seg & (HAT_cache_line - 1) )
-			seg->next += HAT_cache_line - round;
-	} else {
-		hat_abort ("No virtual memory");
-	}
+	if( --bucket->count )
+	  return 1;
 
-	MaxMem += amt + HAT_seg;
+	hat_publish (slot, 0);
+	hat_free (hat, bucket, HAT_bucket);
+	return 1;
+  }
 
-	hat = (Hat *)((uchar *)seg + HAT_seg);
+  //  radix node: delete from the child for the next
+  //  key byte, deferring collapse to the highest radix
+  //  node that falls under the threshold
 
-	memset(hat, 0, amt);
-	hat->bootlvl = boot;
- 	hat->aux = aux;
- 	hat->seg = seg;
+  if( off < max )
+	ch = buff[off++] + HAT_binary;
+  else
+	ch = 0;
 
-	if( !boot )
-		*hat->root = (HatSlot)hat_alloc (hat, HAT_bucket) | HAT_bucket;
+  if( !(next = hat_radix_find (node, ch)) || !*next )
+	return 0;
 
-	return hat;
+  count = hat_radix_count (node);
+
+  if( !hat_del_node (hat, next, buff, off, max, 0, *count - 1 > HAT_collapse) )
+	return 0;
+
+  if( !--*count ) {
+	hat_publish (slot, 0);
+	hat_free_node (hat, node);
+	return 1;
+  }
+
+  if( !*next )
+	hat_radix_remove (hat, slot, ch);
+
+  if( fold && *hat_radix_count (*slot) <= HAT_collapse )
+	hat_collapse (hat, slot);
+
+  return 1;
 }
 
-void hat_close (Hat *hat)
+//	hat_delete: remove string from hat array
+//	returning 1 if it was present, or 0
+
+int hat_delete (Hat *hat, uchar *buff, uint max)
 {
-HatSeg *seg, *nxt = hat->seg;
+uint triple = 0;
+uint off = 0;
+uint tst;
 
-	while( (seg = nxt) )
-		nxt = seg->seg, free (seg);
+  if( hat->main->image )
+	hat_abort ("hat_delete on a mapped hat");
+
+#ifdef HAT_EBR
+  if( hat->retired >= HAT_reclaim )
+	hat_reclaim (hat);
+#endif
+
+  for( tst = 0; tst < hat->bootlvl; tst++ ) {
+	triple *= HAT_fanout;
+	if( off < max )
+	  triple += buff[off++] + HAT_binary;
+  }
+
+  if( !hat->root[triple] )
+	return 0;
+
+  return hat_del_node (hat, &hat->root[triple], buff, off, max, 0, 1);
 }
 
-//	compute hash code for key
+//	index of the key's root slot
 
-uint hat_code (uchar *buff, uint max)
+uint hat_root (Hat *hat, uchar *buff, uint max)
 {
-uint hash = max;
+uint triple = 0;
+uint off = 0;
+uint tst;
 
-	while( max-- )
-		hash += (hash << 5) + (hash >> 27) + *buff++;
+  for( tst = 0; tst < hat->bootlvl; tst++ ) {
+	triple *= HAT_fanout;
+	if( off < max )
+	  triple += buff[off++] + HAT_binary;
+  }
 
-	return hash;
+  return triple;
 }
 
-void *hat_add_array (Hat *hat, HatSlot *parent, uchar *buff, uint amt, int pail);
-void *hat_new_array (Hat *hat, HatSlot *parent, uchar *buff, uint amt);
+//	latch the stripe guarding the key's root slot,
+//	nothing above the root slot is ever changed
 
-//	add new key to existing HAT_pail node
-//	return auxilliary area pointer, or
-//	NULL if it doesn't fit PAIL array
+volatile uint *hat_stripe (Hat *hat, uchar *buff, uint max)
+{
+  return &hat->locks[hat_root (hat, buff, max) % HAT_stripes].latch;
+}
+
+//	hat_cell_mt: insert a string through a hat_thread
+//	handle, copying aux bytes from value into its data
+//	area before the latch is released, as another writer
+//	may move the data area once it is
 
-void *hat_add_pail (Hat *hat, HatSlot *parent, uchar *buff, uint amt)
+void hat_cell_mt (Hat *hat, uchar *buff, uint max, void *value)
 {
-HatPail *pail = (HatPail *)(*parent & HAT_mask);
-uint slot = hat_code (buff, amt) % HatPailMax;
+volatile uint *latch = hat_stripe (hat, buff, max);
 void *cell;
 
-	if( !pail->array[slot] )
-		return hat_new_array (hat, &pail->array[slot], buff, amt);
-
-	//	does room exist in slot?
+	hat_lock (latch);
+	cell = hat_cell (hat, buff, max);
 
-	if( cell = hat_add_array (hat, &pail->array[slot], buff, amt, 0) )
-		return cell;
+	if( hat->aux && value )
+		memcpy (cell, value, hat->aux);
 
-	return NULL;
+	hat_unlock (latch);
 }
 
-//	create new HAT_pail node
-//	from full HAT array node
-//	by bursting it
+//	hat_find_mt: find a string while writers are active,
+//	copying its aux bytes into value, return TRUE/FALSE.
+//	Under HAT_EBR the handle's reader finds the key without
+//	taking the latch, restarting if a writer held it
+//	meanwhile, as the aux bytes may have been torn.
 
-void *hat_new_pail (Hat *hat, HatSlot *parent, uchar *buff, uint amt)
+int hat_find_mt (Hat *hat, uchar *buff, uint max, void *value)
 {
-HatBase *base = (HatBase *)(*parent & HAT_mask);
-ushort tst = 0, len, cnt = 0;
-HatPail *pail;
-uchar *cell;
-uint code;
-
-	// strip array node keys into HAT_pail structure
-
-	pail = hat_alloc (hat, HAT_pail);
-	*parent = (HatSlot)pail | HAT_pail;
+volatile uint *latch = hat_stripe (hat, buff, max);
+#ifdef HAT_EBR
+uint version;
+#endif
+void *cell;
 
-	//	burst array node into new PAIL node
+#ifdef HAT_EBR
+  if( hat->reader >= 0 ) {
+	hat_enter (hat, hat->reader);
 
-	while( tst < base->nxt ) {
-	  len = base->keys[tst++];
+	do {
+	  version = hat_stable (latch);
 
-	  if( len & 0x80 )
-		len &= 0x7f, len += base->keys[tst++] << 7;
+	  if( cell = hat_find (hat, buff, max) )
+		if( hat->aux && value )
+		  memcpy (value, cell, hat->aux);
+	} while( !hat_validate (latch, version) );
 
-	  code = hat_code (base->keys + tst, len) % HatPailMax;
+	hat_exit (hat, hat->reader);
+	return cell != NULL;
+  }
+#endif
 
-	  if( pail->array[code] ) {
-		cell = hat_add_array (hat, &pail->array[code], base->keys + tst, len, 0);
-		if( hat->aux )
-			memcpy(cell, (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux, hat->aux);
-	  } else {
-		cell = hat_new_array (hat, &pail->array[code], base->keys + tst, len);
-		if(  hat->aux )
-			memcpy (cell, (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux, hat->aux);
-	  }
+	hat_lock (latch);
+	cell = hat_find (hat, buff, max);
 
-	  tst += len;
-	  cnt++;
-	}
+	if( cell && hat->aux && value )
+		memcpy (value, cell, hat->aux);
 
-	hat_free (hat, base, base->type);
-	return hat_add_pail (hat, parent, buff, amt);
+	hat_unlock (latch);
+	return cell != NULL;
 }
 
-//	promote full array nodes to next larger size
-//	if configured, overflow to HAT_pail node
+//	hat_delete_mt: remove a string through a hat_thread handle
 
-void *hat_promote (Hat *hat, HatSlot *parent, uchar *buff, int amt, int pail)
+int hat_delete_mt (Hat *hat, uchar *buff, uint max)
 {
-HatBase *base = (HatBase *)(*parent & HAT_mask);
-uchar *oldslots, *newslots;
-ushort tst, len, skip;
-uint type, oldtype;
-HatBase *newbase;
+volatile uint *latch = hat_stripe (hat, buff, max);
+int found;
 
-	if( amt > 0x7f )
-		skip = 2;
-	else
-		skip = 1;
+	hat_lock (latch);
+	found = hat_delete (hat, buff, max);
+	hat_unlock (latch);
+	return found;
+}
 
-	oldtype = type = base->type;
-	oldslots = (uchar *)base + HatSize[type];
+//	write-ahead log: hat_log_cell and hat_log_delete
+//	append a record of each change to a buffer.  In
+//	durable mode each writer then waits for an fsync
+//	that covers its record: the first writer to get the
+//	file writes out the buffer and fsyncs for every record
+//	appended so far, and the writers behind it find their
+//	records covered.  Writers go on filling a second
+//	buffer during the fsync.  The file starts with a 16
+//	byte header, and each record is a four byte length,
+//	low byte first, with the top bit set for a delete,
+//	a CRC-32 of the length, key and aux bytes, then the
+//	key, then for an insert the key's aux bytes.
+
+#define HAT_log_magic "HATlog02"
+#define HAT_log_head 16
+#define HAT_log_rec 8
+#define HAT_log_delete 0x80000000
+#define HAT_log_buff (1024 * 1024)
+
+uint HatCrc[256];
+
+void hat_crc_init (void)
+{
+uint idx, bit, crc;
 
-	//	calculate new array node big enough to contain keys
-	//	and associated slots
+	for( idx = 0; idx < 256; idx++ ) {
+		for( crc = idx, bit = 0; bit < 8; bit++ )
+			crc = crc & 1 ? crc >> 1 ^ 0xEDB88320 : crc >> 1;
 
-	if( !hat->aux || base->cnt < 255 )
-	  do if( (base->cnt + 1) * hat->aux + base->nxt + amt + skip + sizeof(HatBase) > HatSize[type] )
-		continue;
-	   else
-		break;
-	  while( type++ < HatMax );
-	else
-	  type = HatMax + 1;
+		HatCrc[idx] = crc;
+	}
+}
 
-	//  see if new key fits into largest array
-	//	if not, promote to HAT_pail as configured
+//	continue a CRC-32 over more bytes, starting
+//	from zero for the first ones
 
-	if( type > HatMax )
-	  if( pail && HatPailMax )
-		return hat_new_pail (hat, parent, buff, amt);
-	  else
-		return NULL;
+uint hat_crc (uint crc, uchar *buff, uint len)
+{
+	crc = ~crc;
 
-	// promote node to next larger size
+	while( len-- )
+		crc = HatCrc[(crc ^ *buff++) & 0xff] ^ crc >> 8;
 
-	newbase = hat_alloc (hat, type);
-	*parent = (HatSlot)newbase | HAT_array;
-	newslots = (uchar *)newbase + HatSize[type];
+	return ~crc;
+}
 
-	//	copy old node contents
+typedef struct {
+	FILE *file;			// log file
+	uchar *buff;		// records being appended
+	uchar *spare;		// records being written out
+	uint used;			// bytes used in buff
+	uint max;			// bytes allocated for each buffer
+	int durable;		// writers wait for an fsync covering their record
+	int failed;			// a write or fsync failed
+	unsigned long long appended;	// records appended
+	volatile unsigned long long synced;	// records known durable
+	volatile uint latch;	// guards the append buffer
+	volatile uint flush;	// guards the file, taken before latch
+} HatLog;
+
+uint hat_log_get (uchar *buff)
+{
+	return buff[0] | buff[1] << 8 | buff[2] << 16 | (uint)buff[3] << 24;
+}
 
-	memcpy (newbase->keys, base->keys, base->nxt);	// copy keys in node
+void hat_log_set (uchar *buff, uint val)
+{
+	buff[0] = val, buff[1] = val >> 8, buff[2] = val >> 16, buff[3] = val >> 24;
+}
 
-	if( hat->aux )
-		memcpy (newslots - base->cnt * hat->aux, oldslots - base->cnt * hat->aux, base->cnt * hat->aux);	//	copy user slots
+//	hat_bulk_load worker state
 
-	//	append new node
+typedef struct {
+	Hat *hat;			// worker's thread handle
+	uchar *buff;		// newline delimited keys
+	unsigned long long size;	// bytes in buff
+	unsigned long long added;	// new keys inserted
+	uint part;			// root slots this worker takes
+	uint parts;			// number of workers
+	int log;			// buff holds log records, not lines
+} HatBulk;
+
+//	replay the log records whose root slot falls in
+//	the worker's part, counting them in added
+
+void hat_bulk_replay (HatBulk *bulk)
+{
+Hat *hat = bulk->hat;
+unsigned long long off;
+volatile uint *latch;
+uint hdr, max;
+uchar *key;
+void *cell;
 
-	tst = base->nxt;
-	newbase->keys[tst] = amt & 0x7f;
+	for( off = 0; off < bulk->size; off += HAT_log_rec + max + (hdr & HAT_log_delete ? 0 : hat->aux) ) {
+		hdr = hat_log_get (bulk->buff + off);
+		max = hdr & ~HAT_log_delete;
+		key = bulk->buff + off + HAT_log_rec;
 
-	if( amt & 0x80 )
-		newbase->keys[tst] |= 0x80, newbase->keys[tst + 1] = amt >> 7;
+		if( hat_root (hat, key, max) % bulk->parts != bulk->part )
+		  continue;
 
-	memcpy (newbase->keys + tst + skip, buff, amt);
+		latch = hat_stripe (hat, key, max);
+		hat_lock (latch);
 
-	newbase->nxt = tst + amt + skip;
-	newbase->cnt = base->cnt + 1;
-	newbase->type = type;
+		if( hdr & HAT_log_delete )
+		  hat_delete (hat, key, max);
+		else if( (cell = hat_cell (hat, key, max)) && hat->aux )
+		  memcpy (cell, key + max, hat->aux);
 
-	hat_free (hat, base, oldtype);
-	return newslots - newbase->cnt * hat->aux;
+		hat_unlock (latch);
+		bulk->added++;
+	}
 }
 
-//	make new hat array node
-//	to contain new key
-//	guaranteed to fit
+//	every worker scans the whole buffer, which costs
+//	little next to the inserts, and inserts the keys
+//	whose root slot falls in its part.  As no two
+//	workers share a root subtree, the latches they
+//	take are never contended by each other.
 
-void *hat_new_array (Hat *hat, HatSlot *parent, uchar *buff, uint amt)
+HAT_worker hat_bulk_worker (void *arg)
 {
-uint type = HAT_1;
-HatBase *base;
-ushort skip;
-
-	if( amt > 0x7f )
-		skip = 2;
-	else
-		skip = 1;
+HatBulk *bulk = arg;
+Hat *hat = bulk->hat;
+unsigned long long off, prev;
+volatile uint *latch;
+uint max;
 
-	while( hat->aux + amt + skip + sizeof(HatBase) > HatSize[type] )
-		type++;
+	if( bulk->log ) {
+		hat_bulk_replay (bulk);
+		return 0;
+	}
 
-	//	new key doesn't fit into largest array
+	for( prev = off = 0; off < bulk->size; off++ )
+	  if( bulk->buff[off] == '\n' ) {
+		max = off - prev;
 
-	if( type > HatMax )
-		return NULL;
+		if( hat_root (hat, bulk->buff + prev, max) % bulk->parts == bulk->part ) {
+		  latch = hat_stripe (hat, bulk->buff + prev, max);
+		  hat_lock (latch);
 
-	base = hat_alloc (hat, type);
-	*parent = (HatSlot)base | HAT_array;
+		  if( !hat_cell (hat, bulk->buff + prev, max) )
+			bulk->added++;
 
-	base->keys[0] = amt & 0x7f;
+		  hat_unlock (latch);
+		}
 
-	if( amt > 0x7f )
-		base->keys[0] |= 0x80, base->keys[1] = amt >> 7;
+		prev = off + 1;
+	  }
 
-	memcpy (base->keys + skip, buff, amt);
-	base->nxt = amt + skip;
-	base->type = type;
-	base->cnt = 1;
-	return (uchar *)base + HatSize[type] - hat->aux;
+	return 0;
 }
 
-//	add to existing hat array node
+//	hat_bulk_load: insert the newline terminated keys
+//	in buff with nthreads workers, each through its own
+//	hat_thread handle, partitioned by root slot.  With a
+//	boot level of zero every key shares the one root
+//	slot, and a single worker does all of the inserts.
+//	Returns the number of new keys, which is only known
+//	when the hat has no aux bytes.  With log set, buff
+//	holds log records instead, and the number replayed
+//	is returned.
+
+unsigned long long hat_bulk (Hat *hat, uchar *buff, unsigned long long size, int nthreads, int log)
+{
+unsigned long long added = 0;
+HatThread *threads;
+HatBulk *bulk;
+int idx;
 
-//	return slot address
-//	  or NULL if it doesn't fit
+	if( nthreads < 1 || !hat->bootlvl )
+		nthreads = 1;
 
-void *hat_add_array (Hat *hat, HatSlot *parent, uchar *buff, uint amt, int pail)
-{
-HatBase *base;
-ushort skip;
-uint type;
+	bulk = calloc (nthreads, sizeof(HatBulk));
+	threads = calloc (nthreads, sizeof(HatThread));
 
-	if( amt > 0x7f )
-		skip = 2;
-	else
-		skip = 1;
+	for( idx = 0; idx < nthreads; idx++ ) {
+		bulk[idx].hat = idx ? hat_thread (hat) : hat;
+		bulk[idx].buff = buff;
+		bulk[idx].size = size;
+		bulk[idx].part = idx;
+		bulk[idx].parts = nthreads;
+		bulk[idx].log = log;
+	}
 
-	base = (HatBase *)(*parent & HAT_mask);
-	type = base->type;
+	for( idx = 1; idx < nthreads; idx++ )
+	  if( hat_spawn (threads + idx, hat_bulk_worker, bulk + idx) )
+		hat_abort ("Unable to start bulk load thread");
 
-	// add key to existing array
+	hat_bulk_worker (bulk);
 
-	if( !hat->aux || base->cnt < 255 )
-	  if( (base->cnt + 1 ) * hat->aux + base->nxt + amt + skip + sizeof(HatBase) <= HatSize[type] ) {
-		memcpy (base->keys + base->nxt + skip, buff, amt);
-		base->keys[base->nxt] = amt & 0x7f;
-		if( amt > 0x7f )
-			base->keys[base->nxt] |= 0x80, base->keys[base->nxt + 1] = amt >> 7;
-		base->nxt += amt + skip;
-		base->cnt++;
-		return (uchar *)base + HatSize[type] - base->cnt * hat->aux;
-	  }
+	for( idx = 1; idx < nthreads; idx++ )
+		hat_join (threads[idx]);
 
-	return hat_promote (hat, parent, buff, amt, pail);
+	for( idx = 0; idx < nthreads; idx++ )
+		added += bulk[idx].added;
+
+	free (threads);
+	free (bulk);
+	return added;
 }
 
-//	burst full array node into new bucket node
+unsigned long long hat_bulk_load (Hat *hat, uchar *buff, unsigned long long size, int nthreads)
+{
+	return hat_bulk (hat, buff, size, nthreads, 0);
+}
 
-void hat_burst_array (Hat *hat, HatSlot *parent)
+//	write the appended records to the file, and fsync it
+//	unless sync is zero.  A sync for record upto returns
+//	as soon as another writer's fsync has covered it, so
+//	waiters need not take the file latch in turn.
+
+int hat_log_drain (HatLog *log, unsigned long long upto, int sync)
 {
-ushort tst, len, type, cnt;
-HatBucket *bucket;
-HatBase *base;
-uchar *cell;
-uint code;
+uint used, spin = 0, version;
+unsigned long long count;
+uchar *buff;
 
-	base = (HatBase *)(*parent & HAT_mask);
-	type = base->type;
-	cnt = tst = 0;
+	while( 1 ) {
+	  if( sync && log->synced >= upto )
+		return !log->failed;
 
-	//	allocate new bucket node
+	  if( !((version = hat_version (&log->flush)) & 1) )
+		if( hat_cas (&log->flush, version, version + 1) )
+		  break;
 
-	bucket = hat_alloc (hat, HAT_bucket);
-	*parent = (HatSlot)bucket | HAT_bucket;
+	  hat_spin (&spin);
+	}
 
-	//	burst array node into new bucket node
+	if( sync && log->synced >= upto ) {
+		hat_unlock (&log->flush);
+		return !log->failed;
+	}
 
-	while( tst < base->nxt ) {
-	  len = base->keys[tst++];
-	  if( len > 0x7f )
-		len &= 0x7f, len += base->keys[tst++] << 7;
+	hat_lock (&log->latch);
+	buff = log->buff;
+	log->buff = log->spare;
+	log->spare = buff;
+	used = log->used;
+	log->used = 0;
+	count = log->appended;
+	hat_unlock (&log->latch);
 
-	  code = hat_code (base->keys + tst, len) % HatBucketSlots;
+	if( used && fwrite (buff, used, 1, log->file) != 1 )
+		log->failed = 1;
 
-	  if( bucket->slots[code] ) {
-		cell = hat_add_array (hat, &bucket->slots[code], base->keys + tst, len, 1);
-		if( hat->aux )
-		  memcpy (cell, (uchar *)base + HatSize[type] - (cnt + 1) * hat->aux, hat->aux);
-	  } else {
-		cell = hat_new_array (hat, &bucket->slots[code], base->keys + tst, len);
-		if( hat->aux )
-		  memcpy (cell, (uchar *)base + HatSize[type] - (cnt + 1) * hat->aux, hat->aux);
-	  }
+	if( sync ) {
+	  if( fflush (log->file) || hat_fsync (log->file) )
+		log->failed = 1;
 
-	  bucket->count++;
-	  tst += len;
-	  cnt++;
+	  log->synced = count;
 	}
 
-	hat_free (hat, base, type);
+	hat_unlock (&log->flush);
+	return !log->failed;
 }
 
-//	burst overflowing HAT_pail hash table into HAT_bucket hash table
+//	append one record, returning its record number
 
-void hat_burst_pail (Hat *hat, HatSlot *parent)
+unsigned long long hat_log_add (HatLog *log, uint hdr, uchar *buff, uint max, void *value, uint aux)
 {
-HatPail *pail = (HatPail *)(*parent & HAT_mask);
-ushort tst, len, type, cnt, idx;
-HatBucket *bucket;
-HatBase *base;
-uchar *cell;
-uint code;
-
-	//	allocate new bucket node
+uint need = HAT_log_rec + max + aux, crc;
+unsigned long long lsn;
+uchar len[4];
 
-	bucket = hat_alloc (hat, HAT_bucket);
-	*parent = (HatSlot)bucket | HAT_bucket;
-
-	//	burst pail array into new bucket node
-
-	for( idx = 0; idx < HatPailMax; idx++ ) {
-	 base = (HatBase *)(pail->array[idx] & HAT_mask);
-	 if( !base )
-		continue;
+	hat_log_set (len, hdr | max);
+	crc = hat_crc (0, len, 4);
+	crc = hat_crc (crc, buff, max);
 
-	 cnt = tst = 0;
+	if( aux )
+		crc = hat_crc (crc, value, aux);
 
-	 while( tst < base->nxt ) {
-	  len = base->keys[tst++];
+	while( 1 ) {
+	  hat_lock (&log->latch);
 
-	  if( len & 0x80 )
-		len &= 0x7f, len += base->keys[tst++] << 7;
+	  if( log->used + need <= log->max )
+		break;
 
-	  code = hat_code (base->keys + tst, len) % HatBucketSlots;
+	  hat_unlock (&log->latch);
+	  hat_log_drain (log, 0, 0);
+	}
 
-	  if( bucket->slots[code] ) {
-		if( (bucket->slots[code] & HAT_type) == HAT_array ) {
-		  cell = hat_add_array (hat, &bucket->slots[code], base->keys + tst, len, 1);
-		  if( hat->aux )
-			memcpy (cell, (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux, hat->aux);
-		} else {
-		  cell = hat_add_pail (hat, &bucket->slots[code], base->keys + tst, len);
-		  if( hat->aux )
-			memcpy (cell, (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux, hat->aux);
-		}
-	  } else {
-		  cell = hat_new_array (hat, &bucket->slots[code], base->keys + tst, len);
-		  if( hat->aux )
-			memcpy (cell, (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux, hat->aux);
-	  }
+	memcpy (log->buff + log->used, len, 4);
+	hat_log_set (log->buff + log->used + 4, crc);
+	memcpy (log->buff + log->used + HAT_log_rec, buff, max);
 
-	   bucket->count++;
-	   tst += len;
-	   cnt++;
-	 }
+	if( aux )
+		memcpy (log->buff + log->used + HAT_log_rec + max, value, aux);
 
-	 hat_free (hat, base, base->type);
-	}
-   hat_free (hat, pail, HAT_pail);
+	log->used += need;
+	lsn = ++log->appended;
+	hat_unlock (&log->latch);
+	return lsn;
 }
 
-//	add key to HAT_bucket node
-
-//	return 1 on success
-//	  or 0 if bucket overflows
+//	return the bytes of good records at the front of
+//	a log, stopping at a record torn by a crash, or one
+//	whose CRC fails, such as a zero filled tail
 
-int hat_add_bucket (Hat *hat, HatSlot *parent, uchar *buff, uint amt, uchar *value)
+unsigned long long hat_log_valid (uchar *buff, unsigned long long size, uint aux)
 {
-HatBucket *bucket;
-uchar *cell;
-uint code;
+unsigned long long off = 0;
+uint hdr, len, crc;
 
-	bucket = (HatBucket *)(*parent & HAT_mask);
-	code = hat_code (buff, amt) % HatBucketSlots;
+	while( off + HAT_log_rec <= size ) {
+		hdr = hat_log_get (buff + off);
 
-	if( bucket->count++ < HatBucketMax )
-	 if( !bucket->slots[code] ) {
-	  cell = hat_new_array (hat, &bucket->slots[code], buff, amt);
-	  if( hat->aux )
-		memcpy (cell, value, hat->aux);
-	  return 1;
-	 } else if( (bucket->slots[code] & HAT_type) == HAT_array ) {
-	  if( cell = hat_add_array (hat, &bucket->slots[code], buff, amt, 1) ) {
-	    memcpy (cell, value, hat->aux);
-		return 1;
-	  } else
-		return 0;
-	 } else
-	  if( cell = hat_add_pail (hat, &bucket->slots[code], buff, amt) ) {
-	    memcpy (cell, value, hat->aux);
-	    return 1;
-	  } else
-		return 0;
+		if( (hdr & ~HAT_log_delete) > 65535 )
+			break;
 
-	return 0;
-}
+		len = (hdr & ~HAT_log_delete) + (hdr & HAT_log_delete ? 0 : aux);
 
-void hat_burst_bucket (Hat *hat, HatSlot *parent);
+		if( off + HAT_log_rec + len > size )
+			break;
 
-//	burst HAT_bucket node node into HAT_radix entry
-//	moving key over one offset
+		crc = hat_crc (0, buff + off, 4);
+
+		if( hat_crc (crc, buff + off + HAT_log_rec, len) != hat_log_get (buff + off + 4) )
+			break;
+
+		off += HAT_log_rec + len;
+	}
+
+	return off;
+}
 
-void hat_add_radix (Hat *hat, HatSlot *radix, uchar *buff, uint max, uchar *value)
+//	hat_log_open: replay the log file at path into the
+//	hat with hat_bulk_load's workers, cut the log off at
+//	the first bad record, and log hat_log_cell and
+//	hat_log_delete calls to it from now on.  If durable
+//	is set, those calls return only once their record is
+//	fsynced, otherwise hat_log_sync makes them durable.
+//	A new file is created if there is none.  Returns the
+//	number of records replayed, or -1 if the file cannot
+//	be used.
+
+long long hat_log_open (Hat *hat, char *path, int durable, int nthreads)
 {
-void *cell;
-uchar ch;
+unsigned long long size, valid, replayed = 0;
+uchar head[HAT_log_head];
+uchar *buff = NULL;
+HatLog *log;
+FILE *file;
 
-  //  shorten key by 1 byte
+	hat = hat->main;
 
-  if( max )
-	ch = buff[0];
-  else
-	ch = 0;
+	if( hat->log || hat->image )
+		return -1;
 
-  //  if radix slot is empty, create new HAT_array node
+	if( !HatCrc[1] )
+		hat_crc_init ();
 
-  if( !radix[ch] ) {
-	cell = hat_new_array (hat, &radix[ch], buff + 1, max ? max - 1 : 0);
-	if( hat->aux )
-		memcpy (cell, value, hat->aux);
-	return;
-  }
+	if( !(file = fopen (path, "r+b")) )
+	  if( !(file = fopen (path, "w+b")) )
+		return -1;
 
-  //  otherwise, add to existing node
+	fseek (file, 0, SEEK_END);
+	size = ftell (file);
+	fseek (file, 0, SEEK_SET);
 
-  do switch( radix[ch] & HAT_type ) {
-	case HAT_bucket:
-	  if( hat_add_bucket (hat, &radix[ch], buff + 1, max - 1, value) )
-		return;
+	if( !size ) {
+		memset (head, 0, HAT_log_head);
+		memcpy (head, HAT_log_magic, 8);
+		hat_log_set (head + 8, hat->aux);
 
-	  hat_burst_bucket (hat, &radix[ch]);
-	  continue;
+		if( fwrite (head, HAT_log_head, 1, file) != 1 || fflush (file) || hat_fsync (file) ) {
+			fclose (file);
+			return -1;
+		}
 
-	case HAT_radix:
-	  radix = (HatSlot *)(radix[ch] & HAT_mask);
-	  hat_add_radix (hat, radix, buff + 1, max - 1, value);
-	  return;
+		size = HAT_log_head;
+	} else {
+		if( !(buff = malloc (size)) )
+			hat_abort ("Out of virtual memory");
+
+		if( size < HAT_log_head || fread (buff, size, 1, file) != 1
+		  || memcmp (buff, HAT_log_magic, 8) || hat_log_get (buff + 8) != hat->aux ) {
+			fclose (file);
+			free (buff);
+			return -1;
+		}
 
-	case HAT_array:
-	  if( cell = hat_add_array (hat, &radix[ch], buff + 1, max - 1, 1) ) {
-		if( hat->aux )
-			memcpy (cell, value, hat->aux);
-		return;
-	  }
+		valid = hat_log_valid (buff + HAT_log_head, size - HAT_log_head, hat->aux);
+		replayed = hat_bulk (hat, buff + HAT_log_head, valid, nthreads, 1);
+		free (buff);
 
-	  hat_burst_array (hat, &radix[ch]);
-	  continue;
+		if( HAT_log_head + valid < size )
+		  if( fflush (file) || hat_truncate (file, HAT_log_head + valid) ) {
+			fclose (file);
+			return -1;
+		  }
 
-	case HAT_pail:
-	  if( cell = hat_add_pail (hat, &radix[ch], buff + 1, max - 1) ) {
-		if( hat->aux )
-			memcpy (cell, value, hat->aux);
-		return;
-	  }
+		size = HAT_log_head + valid;
+	}
 
-	  hat_burst_pail (hat, &radix[ch]);
-	  continue;
-  } while( 1 );
+	fseek (file, size, SEEK_SET);
+
+	if( !(log = calloc (1, sizeof(HatLog))) )
+		hat_abort ("Out of virtual memory");
+
+	log->max = HAT_log_buff + 65536 + 4 + hat->aux;
+	log->buff = malloc (log->max);
+	log->spare = malloc (log->max);
+
+	if( !log->buff || !log->spare )
+		hat_abort ("Out of virtual memory");
+
+	log->file = file;
+	log->durable = durable;
+	hat->log = log;
+	return replayed;
 }
 
-//	decompose full bucket to radix node
+//	hat_log_cell: hat_cell_mt that also logs the key
+//	and its aux bytes.  The record is appended under the
+//	root latch, so the log holds the changes to a key in
+//	the order they were made.  In durable mode, waits for
+//	an fsync covering the record.  Returns FALSE once
+//	writing the log has failed.
 
-void hat_burst_bucket (Hat *hat, HatSlot *parent)
+int hat_log_cell (Hat *hat, uchar *buff, uint max, void *value)
 {
-HatPail *pail, *chain;
-HatBucket *bucket;
-HatSlot *radix;
-HatBase *base;
-uint hash, idx;
-ushort tst, cnt;
-uchar len;
+volatile uint *latch = hat_stripe (hat, buff, max);
+HatLog *log = hat->main->log;
+unsigned long long lsn;
+void *cell;
 
-  bucket = (HatBucket *)(*parent & HAT_mask);
+	hat_lock (latch);
+	cell = hat_cell (hat, buff, max);
 
-  if( bucket->count < HatBucketMax )
-	Small++;
+	if( hat->aux && value )
+		memcpy (cell, value, hat->aux);
 
-  //	allocate new hat_radix node
+	lsn = hat_log_add (log, 0, buff, max, cell, hat->aux);
+	hat_unlock (latch);
 
-  radix = hat_alloc (hat, HAT_radix);
-  *parent = (HatSlot)radix | HAT_radix;
+	if( log->durable )
+		return hat_log_drain (log, lsn, 1);
 
-  for( hash = 0; hash < HatBucketSlots; hash++ )
-   if( bucket->slots[hash] )
-    switch( bucket->slots[hash] & HAT_type ) {
-    case HAT_array:
-	  base = (HatBase *)(bucket->slots[hash] & HAT_mask);
-	  cnt = tst = 0;
+	return !log->failed;
+}
 
-	  while( tst < base->nxt ) {
-		len = base->keys[tst++];
-		if( len > 0x7f )
-			len &= 0x7f, len += base->keys[tst++] << 7;
-		hat_add_radix (hat, radix, base->keys + tst, len, (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux);
-		tst += len;
-		cnt++;
-	  }
+//	hat_log_delete: hat_delete_mt that also logs the
+//	delete, waiting for it in durable mode.  Returns
+//	TRUE/FALSE for the key.
 
-	  hat_free (hat, base, base->type);
-	  continue;
+int hat_log_delete (Hat *hat, uchar *buff, uint max)
+{
+volatile uint *latch = hat_stripe (hat, buff, max);
+HatLog *log = hat->main->log;
+unsigned long long lsn;
+int found;
 
-	case HAT_pail:
-	  pail = (HatPail *)(bucket->slots[hash] & HAT_mask);
+	hat_lock (latch);
 
-	  for( idx = 0; idx < HatPailMax; idx++ ) {
-	    base = (HatBase *)(pail->array[idx] & HAT_mask);
+	if( (found = hat_delete (hat, buff, max)) )
+		lsn = hat_log_add (log, HAT_log_delete, buff, max, NULL, 0);
 
-		if( !base )
-		  continue;
+	hat_unlock (latch);
 
-  		cnt = tst = 0;
+	if( found && log->durable )
+		hat_log_drain (log, lsn, 1);
 
-		while( tst < base->nxt ) {
-		  len = base->keys[tst++];
+	return found;
+}
 
-		  if( len > 0x7f )
-			len &= 0x7f, len += base->keys[tst++] << 7;
+//	hat_log_sync: make every change logged so far
+//	durable, returning FALSE if the log has failed
 
-		  hat_add_radix (hat, radix, base->keys + tst, len, (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux);
-		  tst += len;
-		  cnt++;
-		}
+int hat_log_sync (Hat *hat)
+{
+HatLog *log = hat->main->log;
+unsigned long long lsn;
 
-		hat_free (hat, base, base->type);
-	  }
-	  hat_free (hat, pail, HAT_pail);
-	}
+	hat_lock (&log->latch);
+	lsn = log->appended;
+	hat_unlock (&log->latch);
 
-  hat_free (hat, bucket, HAT_bucket);
+	return hat_log_drain (log, lsn, 1);
 }
 
-int keycmp (uchar *str1, uchar *str2, uint len)
+//	sync and close the log of a hat being closed
+
+int hat_log_close (Hat *hat)
 {
-	while( len & (HAT_slot_size - 1) )
-	  if( len--, str1[len] != str2[len] )
-		return 1;
+HatLog *log = hat->log;
+int ok;
 
-	while( len )
-	  if( *(HatSlot *)str1 != *(HatSlot *)str2 )
-		return 1;
-	  else {
-		str1 += HAT_slot_size;
-		str2 += HAT_slot_size;
-		len -= HAT_slot_size;
-	  }
+	ok = hat_log_sync (hat);
 
-	return 0;
+	if( fclose (log->file) )
+		ok = 0;
+
+	free (log->buff);
+	free (log->spare);
+	free (log);
+	hat->log = NULL;
+	return ok;
 }
 
-//	hat_find: find string in hat array
-//	returning a pointer to associated slot
+//	hat_snapshot_async: save an image of the hat from a
+//	forked child, while the parent carries on inserting.
+//	The child sees the trie as it stood at the fork, and
+//	the kernel copies each page the parent writes to
+//	afterwards.  The child reports its progress through
+//	a shared page.
 
-void *hat_find (Hat *hat, uchar *buff, uint max)
+typedef struct {
+	HatProgress *progress;	// shared with the saving child
+	unsigned long long base;	// parent private bytes after the fork
+	int pid;			// saving child, zero once reaped
+	int status;			// 0 running, 1 saved, -1 failed
+} HatSnap;
+
+//	return the private bytes of this process, zero where
+//	the kernel does not report them.  Right after a fork
+//	the whole address space is shared with the child, so
+//	the growth since is what was copied on write or newly
+//	allocated by the parent.
+
+unsigned long long hat_private (void)
 {
-HatSlot next, *table;
-HatBucket *bucket;
-HatBase *base;
-HatPail *pail;
-ushort tst, cnt;
-uint triple = 0;
-uint code, len;
-uint off = 0;
-uchar ch;
+unsigned long long total = 0, kb;
+#ifdef linux
+char line[256];
+FILE *in;
 
-  for( tst = 0; tst < hat->bootlvl; tst++ ) {
-	triple *= 128;
-	if( off < max )
-	  triple += buff[off++];
-  }
+	if( !(in = fopen ("/proc/self/smaps_rollup", "r")) )
+		return 0;
 
-  next = hat->root[triple];
+	while( fgets (line, sizeof(line), in) )
+	  if( sscanf (line, "Private_Clean: %llu", &kb) == 1 || sscanf (line, "Private_Dirty: %llu", &kb) == 1 )
+		total += kb * 1024;
 
-  while( next )
-	switch( next & HAT_type ) {
-	case HAT_array:
-	  base = (HatBase *)(next & HAT_mask);
-	  cnt = tst = 0;
-	  Searches++;
+	fclose (in);
+#endif
+	return total;
+}
 
-	  //  find slot == key
+//	fork a child to write the image to path, returning a
+//	snapshot handle, or NULL if the fork fails.  Writers
+//	through hat_cell_mt only wait while the fork runs, for
+//	it takes every root latch so no insert is half done.
+//	Single threaded callers must not be inside hat_cell.
 
-	  while( tst < base->nxt ) {
-		Probes++;
-		len = base->keys[tst++];	// key length
+void *hat_snapshot_async (Hat *hat, char *path)
+{
+#ifdef _WIN32
+	return NULL;
+#else
+HatProgress *progress;
+HatSnap *snap;
+int idx, pid;
 
-		if( len > 0x7f )
-			len += base->keys[tst++] << 7;
+	progress = mmap (NULL, sizeof(HatProgress), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 
-		if( len == max - off )
-		  if( !keycmp (base->keys + tst, buff + off, len) )
-			if( hat->aux )
-			  return (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux;
-			else
-			  return (void *)1;
-		tst += len;
-		cnt++;
-	  }
+	if( progress == MAP_FAILED )
+		return NULL;
 
-	  return NULL;
+	memset (progress, 0, sizeof(HatProgress));
+	hat = hat->main;
 
-	case HAT_pail:
-	  pail = (HatPail *)(next & HAT_mask);
-	  Pail++;
+	for( idx = 0; idx < HAT_stripes; idx++ )
+		hat_lock (&hat->locks[idx].latch);
 
-	  code = hat_code (buff + off, max - off) % HatPailMax;
+	pid = fork ();
 
-	  if( next = pail->array[code] )
-		continue;
+	if( !pid )
+		_exit (hat_save_image (hat, path, progress) ? 0 : 1);
 
-	  return NULL;
+	for( idx = 0; idx < HAT_stripes; idx++ )
+		hat_unlock (&hat->locks[idx].latch);
 
-	case HAT_bucket:
-	  bucket = (HatBucket *)(next & HAT_mask);
-	  Bucket++;
+	if( pid < 0 ) {
+		munmap (progress, sizeof(HatProgress));
+		return NULL;
+	}
 
-	  code = hat_code (buff + off, max - off) % HatBucketSlots;
+	if( !(snap = malloc (sizeof(HatSnap))) )
+		hat_abort ("Out of virtual memory");
 
-	  if( next = bucket->slots[code] )
-		continue;
+	snap->progress = progress;
+	snap->base = hat_private ();
+	snap->pid = pid;
+	snap->status = 0;
+	return snap;
+#endif
+}
 
-	  return NULL;
+//	report a snapshot's image bytes written and to write,
+//	and the parent bytes copied or allocated since the
+//	fork, any of which may be NULL.  Returns 0 while the
+//	child runs, 1 once the image is saved, -1 on failure.
 
-	case HAT_radix:
-	  table = (HatSlot *)(next & HAT_mask);
-	  Radix++;
+int hat_snapshot_status (void *handle, unsigned long long *done, unsigned long long *size, unsigned long long *copied)
+{
+#ifdef _WIN32
+	return -1;
+#else
+HatSnap *snap = handle;
+unsigned long long now;
+int status;
 
-	  if( off < max )
-		ch = buff[off++];
-	  else
-		ch = 0;
+	if( snap->pid && waitpid (snap->pid, &status, WNOHANG) == snap->pid ) {
+		snap->status = WIFEXITED(status) && !WEXITSTATUS(status) ? 1 : -1;
+		snap->pid = 0;
+	}
 
-	  next = table[ch];
-	  continue;
+	if( done )
+		*done = snap->progress->done;
+	if( size )
+		*size = snap->progress->size;
+
+	if( copied ) {
+		now = hat_private ();
+		*copied = now > snap->base ? now - snap->base : 0;
 	}
 
-	return NULL;
+	return snap->status;
+#endif
 }
 
-//	hat_cell: add string to hat array
-//	returning address of associated slot
+//	wait for the child to finish the image, then free the
+//	snapshot handle.  Returns TRUE/FALSE.
 
-void *hat_cell (Hat *hat, uchar *buff, uint max)
+int hat_snapshot_wait (void *handle)
 {
-HatSlot *table, *next, *parent, node;
-HatBucket *bucket;
-HatBase *base;
-HatPail *pail;
-ushort tst, cnt;
-uint triple = 0;
-uint len, code;
-uint off = 0;
-void *cell;
-uchar ch;
-
-  for( tst = 0; tst < hat->bootlvl; tst++ ) {
-	triple *= 128;
-	if( off < max )
-	  triple += buff[off++];
-  }
-
-  next = &hat->root[triple];
-  parent = NULL;
+#ifdef _WIN32
+	return 0;
+#else
+HatSnap *snap = handle;
+int status, ok;
+
+	if( snap->pid ) {
+	  while( waitpid (snap->pid, &status, 0) < 0 )
+		if( errno != EINTR ) {
+		  status = 1;
+		  break;
+		}
 
-loop:
-  while( node = *next )
-	switch( node & HAT_type ) {
-	case HAT_array:
-	  base = (HatBase *)(node & HAT_mask);
-	  cnt = tst = 0;
+	  snap->status = WIFEXITED(status) && !WEXITSTATUS(status) ? 1 : -1;
+	}
 
-	  //  find slot == key
+	ok = snap->status > 0;
+	munmap (snap->progress, sizeof(HatProgress));
+	free (snap);
+	return ok;
+#endif
+}
 
-	  while( tst < base->nxt ) {
-		len = base->keys[tst++];	// key length
+//	hat_count: number of nodes of an allocation class
+//	in use, over the hat and all of its thread handles
 
-		if( len > 0x7f )
-			len += base->keys[tst++] << 7;
+int hat_count (Hat *hat, uint type)
+{
+int count = 0;
 
-		if( len == max - off )
-		  if( !keycmp (base->keys + tst, buff + off, max - off) )
-			if( hat->aux )
-			  return (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux;
-			else
-			  return (void *)1;
+	for( hat = hat->main; hat; hat = hat->threads )
+		count += hat->counts[type];
 
-		tst += len;
-		cnt++;
-	  }
+	return count;
+}
 
-	  //  if parent node is a full bucket node,
-	  //  burst it and loop to reprocess insert
+//	demonstration sort program
 
-	  if( parent ) {
-		if( bucket->count++ < HatBucketMax )
-		  if( cell = hat_add_array (hat, next, buff + off, max - off, 1) )
-			if( hat->aux )
-			  return cell;
-			else
-			  return (void *)0;
+//	the sorted output is cut into chunks of root slots
+//	holding about equal numbers of keys, which are
+//	formatted into their own buffers by any thread
+//	and written out in order by the calling thread.
+//	Chunks are claimed no more than a window ahead
+//	of the last one written, bounding the buffers.
 
-		hat_burst_bucket (hat, parent);
-		next = parent;
-		parent = NULL;
-		continue;
-	  }
+typedef struct {
+	uint first;			// first root slot of chunk
+	uint last;			// root slot after chunk
+	uchar *out;			// formatted lines
+	unsigned long long len;	// bytes used in out
+	unsigned long long max;	// bytes allocated to out
+	volatile uint done;	// set once out is complete
+} HatChunk;
 
-	  // add new key to existing array or create new pail array node
+typedef struct {
+	Hat *hat;
+	HatChunk *chunks;	// in output order
+	uint count;			// number of chunks
+	uint window;		// chunks claimable past written
+	volatile uint next;	// next chunk to claim
+	volatile uint written;	// chunks written out
+} HatExport;
 
-	  if( cell = hat_add_array (hat, next, buff + off, max - off, 1) )
-		if( hat->aux )
-		  return cell;
-		else
-		  return (void *)0;
+//	number of keys below a root slot
 
-	  //  burst full array node into HAT_bucket node
-	  //  and loop to reprocess the insert
+unsigned long long hat_weight (HatSlot node)
+{
+unsigned long long weight = 0;
+HatPail *pail;
+uint idx;
 
-	  hat_burst_array (hat, next);
-	  continue;
+	switch( node & HAT_type ) {
+	case HAT_array:
+	  return ((HatBase *)(node & HAT_mask))->cnt;
 
 	case HAT_pail:
 	  pail = (HatPail *)(node & HAT_mask);
 
-	  //  find slot == key
+	  for( idx = 0; idx < HatPailMax; idx++ )
+		if( pail->array[idx] )
+		  weight += ((HatBase *)(pail->array[idx] & HAT_mask))->cnt;
 
-	  cnt = tst = 0;
-	  code = hat_code (buff + off, max - off) % HatPailMax;
+	  return weight;
 
-	  if( base = (HatBase *)(pail->array[code] & HAT_mask) )
-	    while( tst < base->nxt ) {
-		 len = base->keys[tst++];	// key length
+	case HAT_bucket:
+	  return ((HatBucket *)(node & HAT_mask))->count;
+	}
 
-		 if( len > 0x7f )
-		  len += base->keys[tst++] << 7;
+	return *hat_radix_count (node);
+}
 
-		 if( len == max - off )
-		  if( !keycmp (base->keys + tst, buff + off, max - off) )
-			if( hat->aux )
-			  return (uchar *)base + HatSize[base->type] - (cnt + 1) * hat->aux;
-			else
-			  return (void *)1;
+//	append a chunk's keys, each repeated by its count
 
-		 tst += len;
-		 cnt++;
-	    }
+void hat_export_chunk (HatCursor *cursor, HatChunk *chunk)
+{
+uchar buff[256];
+uint len, cnt;
+int more;
 
-	  //  if parent node is a full bucket node,
-	  //  burst it and loop to reprocess insert
+	cursor->rootmin = chunk->first;
+	cursor->rootmax = chunk->last;
 
-	 if( parent ) {
-		if( bucket->count++ < HatBucketMax )
-		  if( cell = hat_add_pail (hat, next, buff + off, max - off) )
-			if( hat->aux )
-			  return cell;
-			else
-			  return (void *)0;
+#ifndef REVERSE
+	for( more = hat_first (cursor); more; more = hat_nxt (cursor) ) {
+#else
+	for( more = hat_last (cursor); more; more = hat_prv (cursor) ) {
+#endif
+	  len = hat_key (cursor, buff, sizeof(buff));
+	  cnt = *(uint *)hat_slot (cursor);
 
-		hat_burst_bucket (hat, parent);
-		next = parent;
-		parent = NULL;
-		continue;
+	  while( chunk->len + (unsigned long long)cnt * (len + 1) > chunk->max ) {
+		chunk->max = chunk->max ? chunk->max * 2 : 65536;
+		if( !(chunk->out = realloc (chunk->out, chunk->max)) )
+		  hat_abort ("Out of virtual memory");
 	  }
 
-	  if( cell = hat_add_pail (hat, next, buff + off, max - off) )
-		if( hat->aux )
-		  return cell;
-		else
-		  return (void *)0;
+	  while( cnt-- ) {
+		memcpy (chunk->out + chunk->len, buff, len);
+		chunk->len += len;
+		chunk->out[chunk->len++] = '\n';
+	  }
+	}
 
-	  //  burst full pail node into HAT_bucket node
-	  //  and loop to reprocess the insert
+	hat_bump (&chunk->done);
+}
 
-	  hat_burst_pail (hat, next);
-	  continue;
+//	claim the next chunk, returning -1 if it is
+//	outside the window, or the chunk count once
+//	every chunk has been claimed
 
-	case HAT_bucket:
-	  bucket = (HatBucket *)(node & HAT_mask);
-	  code = hat_code (buff + off, max - off) % HatBucketSlots;
+int hat_export_claim (HatExport *export)
+{
+uint idx;
 
-	  parent = next;
-	  next = &bucket->slots[code];
-	  continue;
+	while( (idx = hat_version (&export->next)) < export->count )
+	  if( idx >= hat_version (&export->written) + export->window )
+		return -1;
+	  else if( hat_cas (&export->next, idx, idx + 1) )
+		return idx;
 
-	case HAT_radix:
-	  table = (HatSlot *)(node & HAT_mask);
+	return export->count;
+}
 
-	  if( off < max )
-	  	ch = buff[off++];
+HAT_worker hat_export_worker (void *arg)
+{
+HatExport *export = arg;
+HatCursor *cursor = hat_cursor (export->hat);
+uint spin = 0;
+int idx;
+
+	while( (idx = hat_export_claim (export)) < (int)export->count )
+	  if( idx < 0 )
+		hat_spin (&spin);
 	  else
-	  	ch = 0;
+		hat_export_chunk (cursor, export->chunks + idx);
 
-	  next = &table[ch];
-	  continue;
-	}
+	hat_cursor_close (cursor);
+	return 0;
+}
 
-	// place new array node under HAT_bucket
-	//	loop if bucket overflows
+//	write the trie's keys in sorted order to stdout,
+//	formatting chunks of it with nthreads threads
 
-	if( parent )
-	  if( bucket->count++ < HatBucketMax ) {
-	   if( cell = hat_new_array (hat, next, buff + off, max - off) )
-		if( hat->aux )
-		  return cell;
-		else
-		  return (void *)0;
+void hat_export (Hat *hat, int nthreads)
+{
+unsigned long long total = 0, weight = 0, idx;
+HatCursor *cursor = hat_cursor (hat);
+uint target, slot, spin = 0;
+HatThread *threads;
+int claim;
+HatExport export[1];
+HatChunk *chunk;
+
+	for( slot = 0; slot < cursor->maxroot; slot++ )
+	  if( hat->root[slot] )
+		total += hat_weight (hat->root[slot]);
+
+	//	aim for bucket sized chunks, and
+	//	several per thread to balance them
+
+	if( nthreads < 1 )
+		nthreads = 1;
+
+	target = total / HatBucketMax + nthreads * 4;
+
+	memset (export, 0, sizeof(export));
+	export->window = nthreads * 2;
+	export->hat = hat;
+	export->chunks = calloc (target + 1, sizeof(HatChunk));
+
+	for( slot = 0; slot < cursor->maxroot; slot++ ) {
+	  if( hat->root[slot] )
+		weight += hat_weight (hat->root[slot]);
+
+	  if( slot + 1 == cursor->maxroot || (total && weight * target >= (export->count + 1) * total) ) {
+		chunk = export->chunks + export->count;
+		chunk->first = export->count ? chunk[-1].last : 0;
+		chunk->last = slot + 1;
+		export->count++;
+	  }
+	}
 
-	   hat_burst_bucket (hat, parent);
-	   next = parent;
-	   parent = NULL;
-	   goto loop;
+#ifdef REVERSE
+	for( idx = 0; idx < export->count / 2; idx++ ) {
+		chunk = export->chunks + export->count - idx - 1;
+		slot = chunk->first, chunk->first = export->chunks[idx].first, export->chunks[idx].first = slot;
+		slot = chunk->last, chunk->last = export->chunks[idx].last, export->chunks[idx].last = slot;
 	}
+#endif
 
-	// place new array node under HAT_radix
+	threads = calloc (nthreads, sizeof(HatThread));
 
-	cell = hat_new_array (hat, next, buff + off, max - off);
+	for( idx = 1; idx < nthreads; idx++ )
+	  if( hat_spawn (threads + idx, hat_export_worker, export) )
+		hat_abort ("Unable to start export thread");
 
-	if( hat->aux )
-		return cell;
+	//	write chunks in order, formatting
+	//	unclaimed ones while waiting
 
-	return (void *)0;
+	for( idx = 0; idx < export->count; idx++ ) {
+	  chunk = export->chunks + idx;
+
+	  while( !hat_version (&chunk->done) )
+		if( (claim = hat_export_claim (export)) >= 0 && claim < export->count )
+		  hat_export_chunk (cursor, export->chunks + claim);
+		else
+		  hat_spin (&spin);
+
+	  if( chunk->len )
+		fwrite (chunk->out, 1, chunk->len, stdout);
+
+	  free (chunk->out);
+	  hat_bump (&export->written);
+	}
+
+	for( idx = 1; idx < nthreads; idx++ )
+		hat_join (threads[idx]);
+
+	free (export->chunks);
+	free (threads);
+	hat_cursor_close (cursor);
 }
 
-//	demonstration sort program
+//	lines are read byte by byte, so under HAT_BINARY they
+//	may hold any byte but newline.  Otherwise the bytes are
+//	masked to 7 bits.  Lines are truncated at 255 bytes.
+//	Compiling with -D THREADS=n formats the output with
+//	n threads.
 
 void sorthattrie (int lvl, FILE *in)
 {
 Hat *hat = hat_open (lvl, sizeof(uint));
 uchar buff[256];
-void *cursor;
+uint max = 0;
 uint *cell;
-uint max;
-	
-	while( fgets (buff, sizeof(buff), in) ) {
-		max = strlen(buff);
-		while( max-- )
-			buff[max] &= 0x7f;
-		cell = hat_cell (hat, buff, strlen(buff) - 1);
+int ch;
+
+	while( (ch = getc (in)) != EOF || max ) {
+		if( ch != '\n' && ch != EOF ) {
+		  if( max < sizeof(buff) - 1 )
+			buff[max++] = HAT_binary ? ch : ch & 0x7f;
+		  continue;
+		}
+
+		cell = hat_cell (hat, buff, max);
 		*cell += 1;
+		max = 0;
 	}
 
-	cursor = hat_cursor (hat);
-
-#ifndef REVERSE
-	if( hat_start (cursor, NULL, 0) )
-	  do {
-		hat_key (cursor, buff, sizeof(buff));
-		cell = hat_slot (cursor);
-		max = *cell;
-		while( max-- )
-			puts (buff);
-	  } while( hat_nxt (cursor) );
+#ifdef THREADS
+	hat_export (hat, THREADS);
 #else
-	if( hat_last (cursor) )
-	  do {
-		hat_key (cursor, buff, sizeof(buff));
-		cell = hat_slot (cursor);
-		max = *cell;
-		while( max-- )
-			puts (buff);
-	  } while( hat_prv (cursor) );
-#endif
-	if( cursor )
-		free (cursor);
-
+	hat_export (hat, 1);
+#endif
 	exit(0);
 }
 
@@ -1800,6 +5862,62 @@ unsigned long long report_process_size(void)
 //	you'll have to break the input file into smaller pieces and load them in 
 //	on-by-one. 
 
+//	check that hat_start left the cursor on the least
+//	key at or above the probe, by stepping back from it
+
+int hat_seek_check (HatCursor *cursor, uchar *probe, uint max)
+{
+uchar key[256];
+HatSort sort[1];
+
+	sort->key = key;
+
+	if( hat_start (cursor, probe, max) ) {
+	  sort->len = hat_key (cursor, key, sizeof(key));
+
+	  if( hat_seekcmp (sort, probe, max > 255 ? 255 : max) < 0 )
+		return 0;
+
+	  if( !hat_prv (cursor) )
+		return 1;
+	} else if( !hat_last (cursor) )
+	  return 1;
+
+	sort->len = hat_key (cursor, key, sizeof(key));
+	return hat_seekcmp (sort, probe, max > 255 ? 255 : max) < 0;
+}
+
+//	load the keys in buff into a new hat with a uint
+//	per key, delete every other line, then add them back,
+//	counting added keys whose data isn't zero-filled
+
+int hat_reuse_check (int boot, uchar *buff, unsigned long long size)
+{
+Hat *hat = hat_open (boot, sizeof(uint));
+unsigned long long off, prev;
+int pass, line, dirty = 0;
+uint *cell;
+
+	for( pass = 0; pass < 3; pass++ )
+	  for( line = prev = off = 0; off < size; off++ )
+		if( buff[off] == '\n' ) {
+		  if( !pass )
+			*(uint *)hat_cell (hat, buff + prev, off - prev) = 1;
+		  else if( line & 1 ) {
+			if( pass == 1 )
+			  hat_delete (hat, buff + prev, off - prev);
+			else if( cell = hat_cell (hat, buff + prev, off - prev), *cell )
+			  dirty++;
+		  }
+
+		  prev = off + 1;
+		  line++;
+		}
+
+	hat_close (hat);
+	return dirty;
+}
+
 int Words = 0;
 int Inserts = 0;
 int Missing = 0;
@@ -1813,6 +5931,11 @@ char *askitis;
 int idx = HAT_1 - 1;
 int boot = 3;
 HatSlot *cell;
+uchar *keys[1024];
+uint lens[1024];
+void *found[1024];
+HatCursor *cursor;
+uint batch = 0;
 
 double insert_real_time=0.0;
 double search_real_time=0.0;
@@ -1897,6 +6020,15 @@ unsigned long long startcycles, stopcycles;
 	*start = clock();
 #endif
 
+#ifdef THREADS
+	Inserts = hat_bulk_load (hat, (uchar *)askitis, size, THREADS);
+
+	for( off = 0; off < size; off++ )
+	  if( askitis[off] == '\n' )
+		Words++;
+
+	Found = Words - Inserts;
+#else
 	for( prev = off = 0; off < size; off++ )
 	  if( askitis[off] == '\n' ) {
 		Words++;
@@ -1906,6 +6038,7 @@ unsigned long long startcycles, stopcycles;
 			Inserts++;
 		prev = off + 1;
 	  }
+#endif
 
 //	naskitis.com:
 //	Stop the timer and do some math to compute the time required to insert the strings into the hat array.
@@ -1927,6 +6060,10 @@ unsigned long long startcycles, stopcycles;
 	free (askitis);
 	fprintf(stderr, "HatArray@Karl_Malbrain\nDASKITIS option enabled\n-------------------------------\n%-20s %.2f MB\n%-20s %.2f sec\n",
     "Hat Array size:", MaxMem/1000000., "Time to insert:", insert_real_time);
+	fprintf(stderr, "%-20s %s\n", "Slot selection:", HAT_slot_mode);
+#ifdef THREADS
+	fprintf(stderr, "%-20s %d\n", "Load threads:", THREADS);
+#endif
 #if !defined(_WIN32)
 	fprintf(stderr, "%-20s %.2f MB\n", "Process Size:", report_process_size()/1000000.);
 #endif
@@ -1935,12 +6072,15 @@ unsigned long long startcycles, stopcycles;
 	fprintf(stderr, "%-20s %d\n", "Found:", Found);
 	fprintf(stderr, "%-20s %d\n", "Cycles/Insert", (stopcycles - startcycles)/Words);
 	fprintf(stderr, "%-20s %d\n", "Short Bucket:", Small);
-	fprintf(stderr, "%-20s %d\n", "Radix Nodes:", hat->counts[0]);
-	fprintf(stderr, "%-20s %d\n", "Bucket Nodes:", hat->counts[1]);
-	fprintf(stderr, "%-20s %d\n", "Pail Nodes:", hat->counts[3]);
+	fprintf(stderr, "%-20s %d\n", "Radix Nodes:", hat_count (hat, HAT_radix));
+	fprintf(stderr, "%-20s %d\n", "Radix48 Nodes:", hat_count (hat, HAT_node48));
+	fprintf(stderr, "%-20s %d\n", "Radix16 Nodes:", hat_count (hat, HAT_node16));
+	fprintf(stderr, "%-20s %d\n", "Radix4 Nodes:", hat_count (hat, HAT_node4));
+	fprintf(stderr, "%-20s %d\n", "Bucket Nodes:", hat_count (hat, 1));
+	fprintf(stderr, "%-20s %d\n", "Pail Nodes:", hat_count (hat, 3));
 
 	for( idx = 4; idx <= HatMax; idx++ )
-	  fprintf(stderr, "HAT_%.4d Nodes:      %d\n", HatSize[idx], hat->counts[idx]);
+	  fprintf(stderr, "HAT_%.4d Nodes:      %d\n", HatSize[idx], hat_count (hat, idx));
 
 	Words = 0;
 	Probes = 0;
@@ -2001,8 +6141,6 @@ unsigned long long startcycles, stopcycles;
 	search_real_time = (*stop - *start) / (float)CLOCKS_PER_SEC;
 #endif
 
-	free (askitis);
-
 	fprintf(stderr,"\n%-20s %.2f sec\n", "Time to search:", search_real_time);
 	fprintf(stderr, "%-20s %d\n", "Words:", Words);
 	fprintf(stderr, "%-20s %d\n", "Missing:", Missing);
@@ -2014,6 +6152,130 @@ unsigned long long startcycles, stopcycles;
 	fprintf(stderr, "%-20s %.2f\n", "Bucket/Search:", (double)Bucket / Words);
 	fprintf(stderr, "%-20s %.2f\n", "Radix/Search:", (double)Radix / Words);
 
+//	search hat array again in batches
+
+	Words = 0;
+	Missing = 0;
+	Found = 0;
+
+#if !defined(_WIN32)
+	gettimeofday(&start, NULL);
+	startcycles = rd_clock();
+#else
+	QueryProcessCycleTime(GetCurrentProcess(), &startcycles);
+	*start = clock();
+#endif
+	for( prev = off = 0; off <= size; off++ )
+	  if( off == size || askitis[off] == '\n' ) {
+		if( off < size ) {
+		  keys[batch] = (uchar *)askitis + prev;
+		  lens[batch++] = off - prev;
+		  prev = off + 1;
+		}
+
+		if( batch < 1024 && off < size )
+		  continue;
+
+		hat_find_batch (hat, keys, lens, found, batch);
+
+		for( idx = 0; idx < batch; idx++ )
+		  if( found[idx] )
+			Found++;
+		  else
+			Missing++;
+
+		Words += batch;
+		batch = 0;
+	  }
+
+#if !defined(_WIN32)
+	gettimeofday(&stop, NULL);
+	search_real_time = 1000.0 * ( stop.tv_sec - start.tv_sec ) + 0.001  
+	* (stop.tv_usec - start.tv_usec );
+	search_real_time = search_real_time/1000.0;
+	stopcycles = rd_clock();
+#else	
+	QueryProcessCycleTime(GetCurrentProcess(), &stopcycles);
+	*stop = clock ();
+	search_real_time = (*stop - *start) / (float)CLOCKS_PER_SEC;
+#endif
+
+	fprintf(stderr,"\n%-20s %.2f sec\n", "Time to batch:", search_real_time);
+	fprintf(stderr, "%-20s %d\n", "Words:", Words);
+	fprintf(stderr, "%-20s %d\n", "Missing:", Missing);
+	fprintf(stderr, "%-20s %d\n", "Found:", Found);
+	fprintf(stderr, "%-20s %d\n", "Cycles/Search", (stopcycles - startcycles)/Words);
+	fprintf(stderr, "%-20s %.2f\n", "nSec/Search:", 1000000000. * search_real_time / Words);
+
+//	seek every 64th search key with one cursor, checking
+//	each lands on the least key at or above it
+
+	cursor = hat_cursor (hat);
+	hat_cursor_limit (cursor, 16);
+	Words = 0;
+	Missing = 0;
+
+	for( prev = off = 0; off < size; off++ )
+	  if( askitis[off] == '\n' ) {
+		if( !(Words++ & 63) )
+		  if( !hat_seek_check (cursor, (uchar *)askitis + prev, off - prev) )
+			Missing++;
+		prev = off + 1;
+	  }
+
+	hat_cursor_close (cursor);
+	fprintf(stderr,"\n%-20s %d\n", "Seeks checked:", (Words + 63) / 64);
+	fprintf(stderr, "%-20s %d\n", "Seek errors:", Missing);
+
+//	delete the search file keys from hat array
+
+	Words = 0;
+	Missing = 0;
+	Found = 0;
+
+#if !defined(_WIN32)
+	gettimeofday(&start, NULL);
+	startcycles = rd_clock();
+#else
+	QueryProcessCycleTime(GetCurrentProcess(), &startcycles);
+	*start = clock();
+#endif
+	for( prev = off = 0; off < size; off++ )
+	  if( askitis[off] == '\n' ) {
+		Words++;
+		if( hat_delete (hat, (uchar *)askitis+prev, off - prev) )
+			Found++;
+		else
+			Missing++;
+		prev = off + 1;
+	  }
+
+#if !defined(_WIN32)
+	gettimeofday(&stop, NULL);
+	search_real_time = 1000.0 * ( stop.tv_sec - start.tv_sec ) + 0.001  
+	* (stop.tv_usec - start.tv_usec );
+	search_real_time = search_real_time/1000.0;
+	stopcycles = rd_clock();
+#else	
+	QueryProcessCycleTime(GetCurrentProcess(), &stopcycles);
+	*stop = clock ();
+	search_real_time = (*stop - *start) / (float)CLOCKS_PER_SEC;
+#endif
+
+	fprintf(stderr,"\n%-20s %.2f sec\n", "Time to delete:", search_real_time);
+	fprintf(stderr, "%-20s %d\n", "Words:", Words);
+	fprintf(stderr, "%-20s %d\n", "Missing:", Missing);
+	fprintf(stderr, "%-20s %d\n", "Deleted:", Found);
+	fprintf(stderr, "%-20s %d\n", "Cycles/Delete", (stopcycles - startcycles)/Words);
+	fprintf(stderr, "%-20s %.2f\n", "nSec/Delete:", 1000000000. * search_real_time / Words);
+	fprintf(stderr, "%-20s %d\n", "Radix Nodes:", hat_count (hat, HAT_radix) + hat_count (hat, HAT_node48) + hat_count (hat, HAT_node16) + hat_count (hat, HAT_node4));
+	fprintf(stderr, "%-20s %d\n", "Bucket Nodes:", hat_count (hat, HAT_bucket));
+	fprintf(stderr, "%-20s %d\n", "Pail Nodes:", hat_count (hat, HAT_pail));
+
+//	re-add deleted keys, checking their data is zero
+
+	fprintf(stderr,"\n%-20s %d\n", "Dirty cells:", hat_reuse_check (boot, (uchar *)askitis, size));
+	free (askitis);
 	exit(0);
 }
 